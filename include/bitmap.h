@@ -0,0 +1,15 @@
+#pragma once
+#include "param.h"
+
+// Scanning bitmaps of nbits bits laid out as the block bitmap on disk: bit i
+// is bit i % 8 of byte i / 8.
+//
+// They go 64 bits at a time with ctz/popcount, and skip the 256 bits spans
+// without the bit looked for with AVX2 when the CPU has it.
+
+// the first bit from the from-th that is 0, nbits if there is none
+uint bitmap_next_zero(const u_char* map, uint nbits, uint from);
+// the first bit from the from-th that is 1, nbits if there is none
+uint bitmap_next_one(const u_char* map, uint nbits, uint from);
+// the number of bits that are 1
+uint bitmap_count(const u_char* map, uint nbits);
@@ -25,4 +25,18 @@ void init_meta_blocks_bmap();
 uint block_alloc();
 void block_free(uint blockno);
 
+// block_alloc() for a block of file contents, zeroed with
+// logged_write_data()
+uint block_alloc_data();
+
+// Allocate a run of at least min and at most max contiguous blocks, the
+// closest after goal (0 for anywhere) in the bitmap, wrapping around. A run
+// doesn't cross a bitmap block, max is at most BPB.
+// The blocks aren't zeroed.
+// @return the first block of the run and its length in nblocks, 0 if there
+// is no such run
+uint block_alloc_extent(uint goal, uint min, uint max, uint* nblocks);
+
 void logged_zero_a_block(uint blockno);
+// logged_zero_a_block() for a block of file contents
+void logged_zero_a_data_block(uint blockno);
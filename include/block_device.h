@@ -1,5 +1,6 @@
 #pragma once
 #include "param.h"
+#include <sys/types.h>
 
 // return: n bytes write
 int write_block_raw(uint block_id, const u_char* buf);
@@ -8,4 +9,33 @@ int write_block_raw(uint block_id, const u_char* buf);
 int read_block_raw(uint block_id, u_char* buf);
 int read_block_raw_nbytes(uint block_id, u_char* buf, uint nbytes);
 
-void block_device_init(const char* path_to_device);
\ No newline at end of file
+// write/read nblocks contiguous blocks starting from block_id
+// return: n bytes write/read
+int write_blocks_raw(uint block_id, const u_char* buf, uint nblocks);
+ssize_t read_blocks_raw(uint block_id, u_char* buf, uint nblocks);
+
+// write nblocks contiguous blocks starting from block_id, the content of the
+// i-th one is bufs[i]. Writes of several threads run in parallel.
+// return: n bytes write
+int write_blocks_vec_raw(uint block_id, const u_char* const* bufs,
+                         uint nblocks);
+
+// the same on the device holding the log: the disk itself, or the external
+// journal given to block_device_init_journal()
+int journal_write_block_raw(uint block_id, const u_char* buf);
+int journal_read_block_raw(uint block_id, u_char* buf);
+ssize_t journal_read_blocks_raw(uint block_id, u_char* buf, uint nblocks);
+int journal_write_blocks_vec_raw(uint block_id, const u_char* const* bufs,
+                                 uint nblocks);
+
+// wait until the writes done to the disk are on stable storage
+// return: 0, -1 on error
+int block_device_flush();
+
+// the same for the device holding the log
+int block_device_flush_journal();
+
+void block_device_init(const char* path_to_device);
+
+// use the external journal at path for the log, after block_device_init()
+void block_device_init_journal(const char* path);
\ No newline at end of file
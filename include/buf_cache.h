@@ -2,16 +2,32 @@
 #include "param.h"
 #include "pthread.h"
 
+#define CACHE_LINE_SIZE 64
+// entries of the per-thread front cache in bget
+#define NBFRONT 4
+
+// buffer header, the data lives in a separate arena so the hash chain walk
+// in bget only touches the first cache line of each header
 struct bcache_buf {
-  int valid;  // has data read from disk?
-  uint blockno;
-  pthread_mutex_t lock;
-  uint refcnt;
+  // hot: bget's lookup and recycle
   struct bcache_buf* prev;
   struct bcache_buf* next;
+  uint blockno;
+  uint refcnt;
   uint64_t timestamp;
-  u_char data[BSIZE];
-};
+  u_char* data;  // BSIZE bytes in the data arena
+  int valid;     // has data read from disk?
+  int resident;  // data page backed by memory? cleared by bcache_shrink()
+
+  // cold
+  pthread_mutex_t lock __attribute__((aligned(CACHE_LINE_SIZE)));
+
+  // owned by the log, under lock
+  uint64_t jtid;   // the last transaction logging it, 0 once installed
+  uint64_t ftid;   // the transaction frozen is the content of
+  u_char* frozen;  // ftid's copy, made when the running transaction
+                   // modifies the block before ftid is in the log
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
 // buffed read and write
 // Return a locked buf with the contents of the indicated block
@@ -24,7 +40,37 @@ int bwrite(struct bcache_buf* b);
 // Release a locked buffer
 void brelse(struct bcache_buf* b);
 
+// Copy blockno's cached content to dst without taking a new buffer
+// @return 1 if blockno is cached, 0 if the caller has to read the disk
+int bread_cached(uint blockno, u_char* dst);
+
+// Drop the cached copy of blockno (if any), called after the block has been
+// written to the disk behind the cache
+void binvalidate(uint blockno);
+
+// The page of the data arena owned by b.
+// b->data may be a copy while the log keeps the page frozen
+u_char* bcache_page(struct bcache_buf* b);
+
 void bpin(struct bcache_buf* b);
 void bunpin(struct bcache_buf* b);
 
+// Read blockno into the cache (if it isn't there yet) and release it
+// immediately, used to warm the cache up in the background
+void bprefetch(uint blockno);
+
+// Fill blocknos with at most max block numbers currently held by the cache,
+// the most recently used first
+// @return the number of block numbers filled
+uint bcache_hot_blocks(uint* blocknos, uint max);
+
+// Give the data pages of the least recently used unreferenced buffers back
+// to the system until at most nbuf buffers hold data.
+// The buffers stay in the cache, empty.
+// @return the number of buffers released
+uint bcache_shrink(uint nbuf);
+
+// @return the number of buffers holding data
+uint bcache_nresident();
+
 void bcache_init();
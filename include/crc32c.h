@@ -0,0 +1,10 @@
+#pragma once
+#include "param.h"
+#include <stddef.h>
+
+// CRC-32C (Castagnoli), the checksum of the log.
+//
+// Uses the SSE4.2 crc32 instruction when the CPU has it, a slicing-by-8 table
+// otherwise. Chains like zlib's crc32(): start with 0, and
+//   crc32c(crc32c(0, a, alen), b, blen) == crc32c(0, ab, alen + blen)
+uint crc32c(uint crc, const void* buf, size_t len);
@@ -27,6 +27,10 @@ int myfuse_read(const char* path, char* buf, size_t size, off_t offset,
 int myfuse_write(const char* path, const char* buf, size_t size, off_t offset,
                  struct fuse_file_info* fi);
 
+int myfuse_fsync(const char* path, int datasync, struct fuse_file_info* fi);
+
+int myfuse_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi);
+
 int myfuse_rmdir(const char* path);
 
 int myfuse_truncate(const char* path, off_t size, struct fuse_file_info* fi);
@@ -46,6 +50,9 @@ int myfuse_statfs(const char* path, struct statvfs* buf);
 
 void file_init();
 
+// free the unused ftable entries, called under memory pressure
+uint ftable_shrink();
+
 enum FD_TYPE {
   FD_NONE = 0,
   FD_INODE,
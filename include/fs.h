@@ -6,7 +6,14 @@
 #define BSIZE ((unsigned long)(4096))
 #define MAXOPBLOCKS 127
 #define NCACHE_BUF (MAXOPBLOCKS * 8)
-#define NLOG (MAXOPBLOCKS * 8)
+// log blocks mkfs gives a disk: 64 MiB, at most 1/16 of it
+#define NLOG_DEFAULT ((64ul << 20) / BSIZE)
+// the log super block, an op's blocks and their descriptor (which may list
+// as many blocks revoked as the cache holds)
+#define NLOG_MIN (MAXOPBLOCKS + 3)
+// the largest log mkfs makes: 1 GiB
+#define NLOG_MAX ((1ul << 30) / BSIZE)
+#define JOURNAL_PATH_MAX 128
 
 // Disk layout:
 // [ boot block (skip) | super block | log | inode blocks |
@@ -23,9 +30,25 @@ struct superblock {
   uint logstart;    // Block number of first log block
   uint inodestart;  // Block number of first inode block
   uint bmapstart;   // Block number of first free map block
+  uint journal;     // 0, or the id of the external journal holding the log
+  char journal_path[JOURNAL_PATH_MAX];  // where mkfs found it
 };
 #define SUPERBLOCK_ID 1
 
+// The log may be on an external journal device (or file) instead, a small
+// fast one taking the log writes off the disk. The disk has no log section
+// then, logstart is the block number on the journal device.
+// External journal layout:
+// [ journal header | log ]
+struct journal_header {
+  uint magic;    // Must be JOURNAL_MAGIC
+  uint fsmagic;  // Must be FSMAGIC
+  uint id;       // sb.journal of the file system it belongs to
+  uint nlog;     // Number of log blocks
+};
+#define JOURNAL_MAGIC 0x6a726e6c  // "jrnl"
+#define JOURNAL_HEADER_ID 0
+
 #define NDIRECT 43
 #define NINDIRECT1 (BSIZE / sizeof(uint))
 #define NINDIRECT2 ((BSIZE / sizeof(uint)) * (BSIZE / sizeof(uint)))
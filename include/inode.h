@@ -87,14 +87,26 @@ struct inode {
   struct timespec st_ctimespec; /* Nsecs of last status change.  */
   uint perm;
   uint addrs[NDIRECT + NSUBDIRECT];
+
+  // the last transactions which changed the inode, and which changed its
+  // contents (or the blocks and size they take), for fsync and fdatasync
+  uint64_t sync_tid;
+  uint64_t datasync_tid;
 };
 
 int stat_inode(struct inode* ip, struct stat* st);
 
+// wait until the changes to ip are committed, only the ones to its contents
+// if datasync. ip must not be locked
+void inode_sync(struct inode* ip, int datasync);
+
 int stat_inum(uint inum, struct stat* st);
 
 int inode_init(struct superblock* sb);
 
+// free the unused in-memory inodes, called under memory pressure
+uint itable_shrink();
+
 void iunlockput(struct inode* ip);
 
 void iput(struct inode* ip);
@@ -116,6 +128,20 @@ struct inode* iget(uint inum);
 
 uint imap2blockno(struct inode* ip, uint bn);
 
+// imap2blockno() without allocating, for reads
+// @return 0 if the bn-th block of ip is a hole
+uint imap2blockno_lookup(struct inode* ip, uint bn);
+
+// Reads and writes covering at least bypass_cache_threshold bytes of full
+// blocks skip the buffer cache: the blocks not cached are transferred
+// between the disk and the caller's buffer directly, so a big streaming
+// request doesn't flush the cache and costs one copy less.
+// The written blocks not logged by the running transaction go to the disk
+// in place (not journaled, like O_DIRECT), their cached copies are dropped.
+// 0 disables the bypass, so does LOG_DATA_JOURNAL mode.
+#define BYPASS_CACHE_THRESHOLD (16 * BSIZE)
+extern size_t bypass_cache_threshold;
+
 // this should called outside a op and ip->lock unlocked
 long inode_write_nbytes_unlocked(struct inode* ip, const char* data,
                                  size_t bytes, size_t off);
@@ -123,6 +149,17 @@ long inode_write_nbytes_unlocked(struct inode* ip, const char* data,
 long inode_read_nbytes_unlocked(struct inode* ip, char* data, size_t bytes,
                                 size_t off);
 
+// A write is carried by the op in chunks of up to INODE_WRITE_CHUNK_NBLOCKS
+// blocks, the op reserving the log blocks of each chunk before writing it.
+// Only between two chunks, if the running transaction can't take the next
+// one, the op is ended and begun again, with ip unlocked meanwhile: a large
+// write may span transactions, a chunk never does.
+// The size grows with each chunk, logged along, so a write extending the
+// file is cut by a crash after a whole chunk.
+// The holes of a chunk are allocated as extents, after the block before
+// them, so a file growing by large writes stays contiguous on disk.
+#define INODE_WRITE_CHUNK_NBLOCKS ((MAXOPBLOCKS - 1 - 2 * 5) / 2)
+
 // this should called inside a op and ip->lock locked
 long inode_write_nbytes_locked(struct inode* ip, const char* data, size_t bytes,
                                size_t off);
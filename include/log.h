@@ -14,18 +14,83 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the journal thread commits or checkpoints.
+// An op reserves the blocks it may log in the transaction, as few as it
+// can: the fewer are reserved, the more ops run at once.
 //
-// the log layout on device is
-// |    header block   | # containing blockno for following blocks
-// | block A's content |
-// | block B's content |
-// | block C's content |
-// |        ...        |
+// Transactions are double-buffered: the running one takes new ops while
+// the previous one is committed. A block modified by both is copied for the
+// committing one in logged_read(), before the running one changes it.
+//
+// Commits are run by a dedicated journal thread, end_op() returns at once.
+// Ops finished within log_commit_interval_ms are committed as a group, or
+// earlier if the transaction reaches LOG_COMMIT_NBLOCKS blocks. A caller
+// asking for durability uses end_op_sync() (or log_sync()) and waits for
+// the commit of its transaction.
+//
+// The log is circular and holds every transaction committed since the last
+// checkpoint. Committed blocks stay pinned in the cache, a checkpoint
+// installs them at their home location in one batch (a block rewritten by
+// many transactions is installed once) and empties the log.
+// Its size is chosen by mkfs, a larger log is checkpointed less often.
+//
+// the log layout on device (the disk's log section, or the external journal
+// after its header) is
+// |    log super block    | # where the first transaction to replay is
+// | descriptor of tid     | # containing blockno for following blocks,
+// |          ...          | # and the delta records of the blocks with a
+// |          ...          | # few bytes changed and the blocks revoked, as
+// |          ...          | # many blocks as they take
+// |   block A's content   |
+// |   block B's content   |
+// | descriptor of tid + 1 |
+// |          ...          | # wraps around to the first block after super
 //
 // take this log system as do operation first on disk's log section, then on the
 // real place;
 
+#define LOG_MAGIC 0x6c6f6721  // "log!"
+
+// Contents of the first block of the log, where to start the recovery.
+// Only rewritten by a checkpoint.
+struct fslogsuper {
+  uint magic;
+  uint64_t tail_tid;  // the first transaction to replay
+  uint64_t tail;      // the position of its descriptor
+};
+
+// Contents of the descriptor, the first blocks of a transaction in the log,
+// followed by the content of its n blocks logged whole.
+// Only the first descriptor block has the header, block[], the nrevoke
+// blocks revoked and then the ndelta delta records go on in the next ones as
+// far as they need.
+// A block revoked by a transaction was freed, its records in the transaction
+// and the earlier ones aren't replayed: it may hold file data written in
+// place since.
+// The descriptor is the commit record too: crc covers it (with crc 0) and
+// the n blocks, a transaction the crash tore doesn't match and isn't
+// replayed. So the whole transaction is written at once, in any order.
+struct fslogheader {
+  uint magic;
+  int n;        // blocks logged whole
+  int nrevoke;  // blocks revoked, following block[]
+  int ndelta;   // blocks logged as a delta record
+  uint size;    // bytes of the descriptor, with the delta records
+  uint64_t tid;
+  uint crc;
+  uint block[];
+};
+
+// A block of which the transaction changed a few bytes: the len bytes from
+// off, replayed on top of the block as the previous transactions left it.
+// Records are 4 bytes aligned.
+struct fslogdelta {
+  uint blockno;
+  uint16_t off;
+  uint16_t len;
+  u_char data[];
+};
+
 void log_init(struct superblock* sb);
 
 // loged_write will not really write to the disk.
@@ -39,13 +104,143 @@ void log_init(struct superblock* sb);
 //
 void logged_write(struct bcache_buf* b);
 
+// logged_write() of a block of which only the n bytes from off changed.
+// The ranges a transaction gets for a block add up, if they span at most
+// LOG_DELTA_MAX_NBYTES the block is logged as a delta record instead of
+// whole, replayed on top of the block as the previous transactions left it.
+// So only for a block written at its home location by the log alone, an
+// inode or bitmap block.
+void logged_write_range(struct bcache_buf* b, uint off, uint n);
+
+// how the blocks of file contents are written
+#define LOG_DATA_JOURNAL 0  // through the log, like the metadata
+#define LOG_DATA_ORDERED 1  // in place, right before the transaction commits
+extern int log_data_mode;
+
+// logged_write() for a block of file contents.
+// In LOG_DATA_ORDERED mode the block isn't logged but kept in the cache
+// until the running transaction commits, and written in place before the
+// transaction (which references it) is. A block still owed to the log is
+// logged anyway, installing it later would overwrite the new content.
+void logged_write_data(struct bcache_buf* b);
+
+// the block freed in the op is not replayed from the log any more, by
+// the recovery or the checkpoint, once the transaction commits. A block
+// logged again later in the same transaction is replayed as that.
+void log_revoke(uint blockno);
+
 // this is a wrapper to bread() to make the interface consistent
 struct bcache_buf* logged_read(uint blockno);
 
 // this is a wrapper to brelse() to make the interface consistent
 void logged_relse(struct bcache_buf* b);
 
+// is blockno logged by a transaction not installed yet (or kept for an
+// ordered write)?
+// such a block must be written through the log, its cached copy is newer
+// than the disk and will be installed at commit
+int log_block_pending(uint blockno);
+
+// the transaction the op of this thread joined in
+uint64_t log_op_tid();
+
+// the transaction an op beginning now would join in
+uint64_t log_running_tid();
+
+// transactions up to the returned one are committed
+uint64_t log_committed_tid();
+
+// every logged block is pinned in the cache until it's installed, this many
+// at most, whatever the size of the log
+#define LOG_MAX_NBLOCKS NCACHE_BUF
+
+// how long the running transaction takes ops after its first write, a longer
+// interval commits fewer and larger transactions (and loses more in a crash)
+#define LOG_COMMIT_INTERVAL_MS 5
+extern int log_commit_interval_ms;
+#define LOG_COMMIT_NBLOCKS (LOG_MAX_NBLOCKS / 2)
+// a block a transaction changed that many bytes of at most is logged as a
+// delta record, in the descriptor
+#define LOG_DELTA_MAX_NBYTES (BSIZE / 4)
+// checkpoint once that many blocks are committed and not installed
+#define LOG_CHECKPOINT_NBLOCKS (LOG_MAX_NBLOCKS / 2)
+// data blocks a transaction keeps for ordered writes, later ones are
+// written in place at once
+#define LOG_ORDERED_NBLOCKS (LOG_MAX_NBLOCKS / 8)
+
+// begin_op_reserve(MAXOPBLOCKS), for an op with no better bound
 void begin_op();
+// begin an op logging at most nblocks (up to MAXOPBLOCKS) blocks.
+// Only a block new to the transaction counts, logging a block again is free.
+void begin_op_reserve(int nblocks);
 void end_op();
 
-extern uint __thread n_log_wrote;
+// reserve nblocks more for the op of this thread, without waiting: an op
+// waiting for room would keep the transaction from being committed.
+// @return 0 if the running transaction has no room (or is being closed),
+// the op has to end and begin again
+int log_extend_op(int nblocks);
+
+// blocks the op of this thread can still log
+int log_op_room();
+
+// end_op(), then wait until the transaction the op joined in is on disk
+void end_op_sync();
+
+// wait until every op ended so far is on disk
+void log_sync();
+
+// wait until transaction tid is on disk, committing it now if it's running.
+// Callers waiting for the same transaction share its commit
+void log_sync_tid(uint64_t tid);
+
+// log_sync(), then wait until every committed block is installed at its
+// home location
+void log_checkpoint();
+
+// Journal statistics.
+// Each commit leaves a record in a ring of the last LOG_STATS_NRECORD ones,
+// its durations are also counted in histograms: bucket i holds the ones
+// from 2^(i-1) (excluded) to 2^i microseconds.
+#define LOG_STATS_NRECORD 256
+#define LOG_STATS_NBUCKET 32
+
+struct log_commit_stats {
+  uint64_t tid;
+  uint nops;            // ops in the group
+  uint nblocks;         // blocks logged
+  uint nabsorbed;       // writes to a block the transaction logged already
+  uint ndelta;          // blocks logged as delta records
+  uint nrevoke;         // blocks revoked
+  uint nordered;        // data blocks written in place before the commit
+  uint nlog;            // log blocks written
+  uint ndesc;           // of which descriptor blocks
+  uint nwait_closing;   // begin_op() waiting for the previous one to close
+  uint nwait_room;      // begin_op() waiting for log space
+  uint64_t wait_us;     // time the ops spent in begin_op() before joining
+  uint64_t close_us;    // from closing the transaction until its ops ended
+  uint64_t ordered_us;  // writing the ordered data blocks
+  uint64_t write_us;    // writing the blocks from the cache to the log
+  uint64_t commit_us;   // from closing the transaction until it's on disk
+  // the checkpoint run since the previous commit, if any
+  uint ninstall;
+  uint64_t install_us;
+};
+
+struct log_stats {
+  uint64_t ncommit;
+  uint64_t ncheckpoint;
+  uint64_t wait_hist[LOG_STATS_NBUCKET];     // an op's time in begin_op()
+  uint64_t commit_hist[LOG_STATS_NBUCKET];   // commit_us
+  uint64_t install_hist[LOG_STATS_NBUCKET];  // a checkpoint's install_us
+};
+
+// copy the last n commit records at most, the oldest first, and the
+// histograms to stats
+// @return the number of records copied
+int log_stats_read(struct log_commit_stats* records, int n,
+                   struct log_stats* stats);
+
+// print the commit records and the histograms to f, as text
+void log_stats_dump(FILE* f);
+
@@ -0,0 +1,26 @@
+#pragma once
+#include "param.h"
+
+// Memory pressure watcher.
+//
+// A background thread gives memory back when the host runs short of it:
+// the clean unreferenced bcache buffers are released (the least recently
+// used first) and the unreferenced itable and ftable entries are freed.
+//
+// Pressure is noticed by
+// * a PSI trigger on the cgroup's memory.pressure (or /proc/pressure/memory
+//   when not in a cgroup v2), if the kernel supports it.
+// * a simple resident set size target: checked every MEM_CHECK_INTERVAL_MS,
+//   the caches shrink while the RSS is above it.
+
+#define MEM_CHECK_INTERVAL_MS 1000
+// the trigger fires when some task stalls 150ms on memory within 2s
+#define MEM_PSI_TRIGGER "some 150000 2000000"
+
+// rss_target_kb: 0 for no RSS target
+void mem_pressure_start(unsigned long rss_target_kb);
+
+void mem_pressure_stop();
+
+// shrink every cache once, keep at most keep_nbuf bcache buffers
+void mem_pressure_shrink(uint keep_nbuf);
@@ -22,6 +22,15 @@ const int sector_per_block = BSIZE / sector_size;
 
 struct myfuse_state* get_myfuse_state();
 
-void init_super_block(uint disk_size_in_sector_block);
+// nlog is the number of log blocks, 0 for NLOG_DEFAULT (at most 1/16 of
+// the disk).
+// With an external journal at journal_path the disk has no log section, the
+// log takes nlog blocks of the journal
+void init_super_block(uint disk_size_in_sector_block, uint nlog = 0,
+                      const char* journal_path = nullptr);
+
+// write the header of the external journal of sb and empty its log, the
+// journal opened by block_device_init_journal()
+void init_external_journal(struct superblock* sb);
 
 void add_rootinode();
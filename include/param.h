@@ -15,5 +15,13 @@ struct myfuse_state {
 
 struct options {
   const char* device_path;
+  const char* warmup_path;
+  int warmup_interval;
+  unsigned long bypass_threshold;
+  unsigned long rss_target;
+  const char* data_mode;
+  int commit_interval_ms;
+  const char* journal_stats_path;
+  const char* journal_path;
   int show_help;
 };
@@ -0,0 +1,33 @@
+#pragma once
+#include "param.h"
+
+// Persistent cache warm-up.
+//
+// The block numbers held by the buffer cache are saved to a small file at
+// unmount (and every `interval' seconds if it's not 0). On the next mount,
+// warmup_start() reads them back and prefetches them into the cache with
+// NWARMUP_THREAD background threads, while the fs keeps serving requests.
+//
+// the warm-up file layout is
+// | struct warmup_header | uint blockno[n] |
+
+#define WARMUP_MAGIC 0x776d7570
+#define NWARMUP_THREAD 4
+
+struct warmup_header {
+  uint magic;    // Must be WARMUP_MAGIC
+  uint fsmagic;  // copy of sb.magic, the file is ignored if not match
+  uint fssize;   // copy of sb.size, the file is ignored if not match
+  uint n;        // number of block numbers followed
+};
+
+// start to prefetch the blocks recorded in path in the background.
+// called after log_init() and inode_init()
+void warmup_start(const char* path, struct superblock* sb, uint interval);
+
+// stop the background threads and save the hot blocks to path
+void warmup_stop();
+
+// save the blocks currently cached to path
+// @return 0 on success, -1 on failed
+int warmup_save(const char* path, struct superblock* sb);
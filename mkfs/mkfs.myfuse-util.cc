@@ -1,25 +1,50 @@
 #include <cmath>
 #include "mkfs.myfuse-util.h"
 #include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <random>
 
-void init_super_block(uint disk_size_in_sector_block) {
+void init_super_block(uint disk_size_in_sector_block, uint nlog,
+                      const char* journal_path) {
   auto sb = &MYFUSE_STATE->sb;
+  memset(sb, 0, sizeof(*sb));
+
+  const uint disk_size = disk_size_in_sector_block;
+  if (nlog == 0) {
+    nlog = std::max<uint>(std::min<uint>(NLOG_DEFAULT, disk_size / 16),
+                          NLOG_MIN);
+  }
+  if (nlog < NLOG_MIN || nlog > NLOG_MAX ||
+      (journal_path == nullptr && nlog > disk_size / 2)) {
+    err_exit("bad log size %u blocks, must be from %u to %lu and half the disk",
+             nlog, NLOG_MIN, NLOG_MAX);
+  }
+  // the log section of the disk, none with an external journal
+  uint ndisklog = nlog;
+  if (journal_path != nullptr) {
+    if (strlen(journal_path) >= JOURNAL_PATH_MAX) {
+      err_exit("journal path %s too long", journal_path);
+    }
+    strcpy(sb->journal_path, journal_path);
+    std::random_device rd;
+    sb->journal = std::max<uint>(rd(), 1);
+    ndisklog    = 0;
+  }
 
-  const uint disk_size     = disk_size_in_sector_block;
-  const uint nlog          = NLOG;
   const uint nbitmap       = (ROUNDUP(disk_size, BPB)) / BPB;
   const uint ninode_blocks = ceil(disk_size / 50) + 1;
   const uint ninodes       = ninode_blocks * IPB;
-  const uint nmeta_blocks  = 2 + nlog + ninode_blocks + nbitmap;
+  const uint nmeta_blocks  = 2 + ndisklog + ninode_blocks + nbitmap;
   const uint nblocks       = disk_size - nmeta_blocks;
   sb->magic                = FSMAGIC;
   sb->ninodes              = ninodes;
   sb->size                 = disk_size;
   sb->nblocks              = nblocks;
   sb->nlog                 = nlog;
-  sb->logstart             = 2;
-  sb->inodestart           = 2 + nlog;
-  sb->bmapstart            = 2 + nlog + ninode_blocks;
+  sb->logstart             = ndisklog ? 2 : JOURNAL_HEADER_ID + 1;
+  sb->inodestart           = 2 + ndisklog;
+  sb->bmapstart            = 2 + ndisklog + ninode_blocks;
 
   const double ONEK = 1024.0;
   myfuse_log("this disk can have about %.2lf GiB storage",
@@ -28,10 +53,28 @@ void init_super_block(uint disk_size_in_sector_block) {
       "nmeta %d (boot, super, log blocks %u, inode blocks %u, bitmap blocks "
       "%u)\n"
       "blocks %d total %d\n",
-      nmeta_blocks, nlog, ninode_blocks, nbitmap, nblocks, disk_size);
+      nmeta_blocks, ndisklog, ninode_blocks, nbitmap, nblocks, disk_size);
   printf("%ld bytes per-block\n", BSIZE);
 }
 
+void init_external_journal(struct superblock* sb) {
+  std::array<u_char, BSIZE> zeros;
+  zeros.fill(0);
+  for (uint i = JOURNAL_HEADER_ID; i < sb->logstart + sb->nlog; i++) {
+    if (journal_write_block_raw(i, zeros.data()) != BSIZE) {
+      err_exit("failed to write the journal");
+    }
+  }
+  auto jh     = (struct journal_header*)zeros.data();
+  jh->magic   = JOURNAL_MAGIC;
+  jh->fsmagic = FSMAGIC;
+  jh->id      = sb->journal;
+  jh->nlog    = sb->nlog;
+  if (journal_write_block_raw(JOURNAL_HEADER_ID, zeros.data()) != BSIZE) {
+    err_exit("failed to write the journal");
+  }
+}
+
 struct myfuse_state* get_myfuse_state() {
   static struct myfuse_state state;
   return &state;
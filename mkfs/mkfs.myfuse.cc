@@ -10,6 +10,7 @@
 #include <string>
 #include <iostream>
 #include <malloc.h>
+#include <climits>
 
 // this give us some utilities
 #include "mkfs.myfuse-util.h"
@@ -17,19 +18,66 @@
 // Disk layout
 // [ boot block (skip) | super block | log | inode blocks |
 //                                           free bit map | data blocks]
+// the log section left out with an external journal
 
 int main(int argc, char* argv[]) {
   std::string user_decide;
   std::string disk_name;
 
-  if (argc != 2) {
-    err_exit(
-        "Usage: %s /dev/<disk name>\n"
-        "\tNote: the disk will be treated as sector size of 512\n",
-        argv[0]);
+  const char* usage =
+      "Usage: %s [-J <journal>] /dev/<disk name> [log size in MiB]\n"
+      "\tNote: the disk will be treated as sector size of 512\n"
+      "\tthe log takes 64 MiB by default (at most 1/16 of the disk), it can\n"
+      "\tbe up to 1 GiB\n"
+      "\t-J puts the log on the external journal device (or file) instead,\n"
+      "\tof the same size\n";
+  std::string journal_name;
+  int opt;
+  while ((opt = getopt(argc, argv, "J:")) != -1) {
+    if (opt != 'J') {
+      err_exit(usage, argv[0]);
+    }
+    journal_name = optarg;
+  }
+  if (argc - optind != 1 && argc - optind != 2) {
+    err_exit(usage, argv[0]);
+  }
+
+  disk_name = argv[optind];
+  uint nlog = 0;
+  if (argc - optind == 2) {
+    // checked before it's narrowed to blocks
+    char* end;
+    unsigned long nmib = strtoul(argv[optind + 1], &end, 10);
+    if (*end != '\0' || nmib == 0 || nmib > (NLOG_MAX * BSIZE) >> 20) {
+      err_exit("bad log size %s, must be at most %lu MiB", argv[optind + 1],
+               (NLOG_MAX * BSIZE) >> 20);
+    }
+    nlog = nmib * (1 << 20) / BSIZE;
   }
 
-  disk_name = argv[1];
+  // the superblock records where the journal is, to find it at mount
+  char journal_path[PATH_MAX];
+  if (!journal_name.empty()) {
+    int fd = open(journal_name.c_str(), O_RDWR);
+    if (fd < 0 || realpath(journal_name.c_str(), journal_path) == nullptr) {
+      err_exit("failed to open journal %s", journal_name.c_str());
+    }
+    off_t journal_size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    // the header and the smallest log, so njournal is at least NLOG_MIN:
+    // nlog 0 would have init_super_block() size the log from the disk
+    if (journal_size < (off_t)((JOURNAL_HEADER_ID + 1 + NLOG_MIN) * BSIZE)) {
+      err_exit("journal %s too small, must hold %u log blocks",
+               journal_name.c_str(), NLOG_MIN);
+    }
+    uint64_t njournal = journal_size / BSIZE - (JOURNAL_HEADER_ID + 1);
+    if (nlog == 0) {
+      nlog = std::min<uint64_t>(NLOG_DEFAULT, njournal);
+    } else if (nlog > njournal) {
+      err_exit("log size %s MiB larger than the journal", argv[optind + 1]);
+    }
+  }
 
   static_assert(BSIZE % sizeof(struct dinode) == 0);
   static_assert(BSIZE % sizeof(struct dirent) == 0);
@@ -60,7 +108,13 @@ int main(int argc, char* argv[]) {
     err_exit("block size too small");
   }
   block_device_init(disk_name.c_str());
-  init_super_block(block_size);
+  if (journal_name.empty()) {
+    init_super_block(block_size, nlog);
+  } else {
+    block_device_init_journal(journal_path);
+    init_super_block(block_size, nlog, journal_path);
+    init_external_journal(&MYFUSE_STATE->sb);
+  }
   std::array<u_char, BSIZE> zeros;
   uint nmeta_blocks = MYFUSE_STATE->sb.size - MYFUSE_STATE->sb.nblocks;
   zeros.fill(0);
@@ -94,5 +148,9 @@ int main(int argc, char* argv[]) {
 
   add_rootinode();
 
+  // the journal thread commits and installs in the background, make sure
+  // it's all at its place
+  log_checkpoint();
+
   return 0;
 }
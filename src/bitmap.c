@@ -0,0 +1,129 @@
+#include "bitmap.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+// skip the whole words from the word-th, up to nfull, with no bit equal to
+// want. @return the first word not skipped
+static uint (*skip_words_impl)(const u_char* map, uint word, uint nfull,
+                               int want);
+static uint (*count_words_impl)(const u_char* map, uint nfull);
+static pthread_once_t bitmap_once = PTHREAD_ONCE_INIT;
+
+// the word-th 64 bits of map, bit i of the word is bit word * 64 + i of the
+// map. Past nbits the bits are 0
+static inline uint64_t load_word(const u_char* map, uint nbits, uint word) {
+  uint64_t w  = 0;
+  uint nbytes = (nbits + 7) / 8 - word * 8;
+  memcpy(&w, map + word * 8, nbytes < 8 ? nbytes : 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  if (nbits < (word + 1) * 64) {
+    w &= ~(~0ULL << (nbits % 64));
+  }
+  return w;
+}
+
+static uint skip_words_sw(const u_char* map, uint word, uint nfull,
+                          int want) {
+  const uint64_t none = want ? 0 : ~0ULL;
+  for (; word < nfull; word++) {
+    uint64_t w;
+    memcpy(&w, map + word * 8, sizeof(w));
+    if (w != none) {
+      break;
+    }
+  }
+  return word;
+}
+
+static uint count_words_sw(const u_char* map, uint nfull) {
+  uint n = 0;
+  for (uint word = 0; word < nfull; word++) {
+    uint64_t w;
+    memcpy(&w, map + word * 8, sizeof(w));
+    n += __builtin_popcountll(w);
+  }
+  return n;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) static uint skip_words_avx2(
+    const u_char* map, uint word, uint nfull, int want) {
+  const __m256i none = _mm256_set1_epi64x(want ? 0 : -1);
+  for (; word + 4 <= nfull; word += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(map + word * 8));
+    v         = _mm256_xor_si256(v, none);
+    if (!_mm256_testz_si256(v, v)) {
+      break;
+    }
+  }
+  return skip_words_sw(map, word, nfull, want);
+}
+
+__attribute__((target("popcnt"))) static uint count_words_popcnt(
+    const u_char* map, uint nfull) {
+  uint n = 0;
+  for (uint word = 0; word < nfull; word++) {
+    uint64_t w;
+    memcpy(&w, map + word * 8, sizeof(w));
+    n += __builtin_popcountll(w);
+  }
+  return n;
+}
+#endif
+
+static void bitmap_init() {
+  skip_words_impl  = skip_words_sw;
+  count_words_impl = count_words_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("avx2")) {
+    skip_words_impl = skip_words_avx2;
+  }
+  if (__builtin_cpu_supports("popcnt")) {
+    count_words_impl = count_words_popcnt;
+  }
+#endif
+}
+
+static uint bitmap_next(const u_char* map, uint nbits, uint from, int want) {
+  pthread_once(&bitmap_once, bitmap_init);
+  if (from >= nbits) {
+    return nbits;
+  }
+  const uint64_t flip = want ? 0 : ~0ULL;
+  const uint nwords   = (nbits + 63) / 64;
+  uint word           = from / 64;
+
+  // the bits equal to want are ones in w
+  uint64_t w = (load_word(map, nbits, word) ^ flip) & (~0ULL << (from % 64));
+  while (w == 0) {
+    word = skip_words_impl(map, word + 1, nbits / 64, want);
+    if (word >= nwords) {
+      return nbits;
+    }
+    w = load_word(map, nbits, word) ^ flip;
+  }
+  uint i = word * 64 + __builtin_ctzll(w);
+  return i < nbits ? i : nbits;
+}
+
+uint bitmap_next_zero(const u_char* map, uint nbits, uint from) {
+  return bitmap_next(map, nbits, from, 0);
+}
+
+uint bitmap_next_one(const u_char* map, uint nbits, uint from) {
+  return bitmap_next(map, nbits, from, 1);
+}
+
+uint bitmap_count(const u_char* map, uint nbits) {
+  pthread_once(&bitmap_once, bitmap_init);
+  uint n = count_words_impl(map, nbits / 64);
+  if (nbits % 64 != 0) {
+    n += __builtin_popcountll(load_word(map, nbits, nbits / 64));
+  }
+  return n;
+}
@@ -1,9 +1,30 @@
 #include "block_allocator.h"
+#include "bitmap.h"
 #include "log.h"
 #include <assert.h>
 
 struct bmap_cache bmap_cache;
 
+// A block freed in LOG_DATA_ORDERED mode isn't handed out again before the
+// transaction freeing it is committed: its new content would be written in
+// place, while the committed metadata may still point to it.
+// It's free on disk but stays allocated in bmap_cache until then, the
+// bitmap written to disk leaves the busy bits out.
+struct freed_block {
+  uint blockno;
+  uint64_t tid;  // the transaction freeing it
+};
+static struct {
+  char* busy;  // bitmap of the blocks in q
+  struct freed_block* q;
+  uint head;
+  uint n;
+  uint cap;
+} freed;
+
+static void block_free_locked(uint blockno);
+static void bmap_cache_free_locked(uint blockno);
+
 void block_allocator_refresh(struct superblock* sb) {
   // init the bmap cache
   uint ncache_blocks   = ROUNDUP(sb->size, BPB) / BPB;
@@ -14,36 +35,32 @@ void block_allocator_refresh(struct superblock* sb) {
       realloc(bmap_cache.n_alloced, ncache_blocks * sizeof(uint));
   bmap_cache.n_cache = ncache_blocks;
   pthread_mutex_init(&bmap_cache.lock, NULL);
+  freed.busy = realloc(freed.busy, ncache_blocks * BSIZE);
+  memset(freed.busy, 0, ncache_blocks * BSIZE);
+  freed.head = 0;
+  freed.n    = 0;
   begin_op();
-  uint blockno    = 0;
-  uint first_free = 0;
+  uint first_free = -1;
   for (uint i = 0; i < ncache_blocks; i++) {
     struct bcache_buf* bp = logged_read(i + sb->bmapstart);
+    const u_char* map     = (u_char*)bmap_cache.cache_buf + i * BSIZE;
 
     memmove(bmap_cache.cache_buf + i * BSIZE, bp->data, BSIZE);
     logged_relse(bp);
 
     // get the first unalloced block and calc the sum of alloced blocks
-    int first_unalloced     = -1;
-    bmap_cache.n_alloced[i] = 0;
-    for (uint j = 0; j < BPB; j++) {
-      if (bmap_block_statue_get(blockno)) {
-        bmap_cache.n_alloced[i]++;
-      } else {
-        if (first_unalloced == -1) {
-          first_unalloced = blockno % BPB;
-        }
-      }
-      blockno++;
-    }
-    bmap_cache.first_unalloced[i] = first_unalloced;
-    if (first_unalloced != -1 && first_free != 0) {
+    uint first_unalloced    = bitmap_next_zero(map, BPB, 0);
+    bmap_cache.n_alloced[i] = bitmap_count(map, BPB);
+    bmap_cache.first_unalloced[i] =
+        first_unalloced == BPB ? -1 : (int)first_unalloced;
+    if (first_unalloced != BPB && first_free == (uint)-1) {
       first_free = i;
     }
   }
   end_op();
+  bmap_cache.first_free_cache = first_free;
 
-  if (bmap_cache.first_free_cache < 0) {
+  if (bmap_cache.first_free_cache == (uint)-1) {
     myfuse_nonfatal(
         "no more free space in the file system\n"
         "any write operation will cause a crash");
@@ -56,6 +73,23 @@ int bmap_block_statue_get(uint blockno) {
   return (bmap_cache.cache_buf[byte] >> bit) & 1;
 }
 
+// write the bits of the nblocks blocks from blockno back to disk, they are
+// in the same bitmap block
+static void bmap_write_back(uint blockno, uint nblocks) {
+  uint first_byte    = blockno / 8;
+  uint last_byte     = (blockno + nblocks - 1) / 8;
+  uint bmapno        = blockno / BPB + MYFUSE_STATE->sb.bmapstart;
+  uint bmap_byte_off = (blockno % BPB) / 8;
+  DEBUG_TEST(assert(blockno / BPB == (blockno + nblocks - 1) / BPB););
+  struct bcache_buf* bp = logged_read(bmapno);
+  for (uint byte = first_byte; byte <= last_byte; byte++) {
+    bp->data[bmap_byte_off + byte - first_byte] =
+        bmap_cache.cache_buf[byte] & ~freed.busy[byte];
+  }
+  logged_write_range(bp, bmap_byte_off, last_byte - first_byte + 1);
+  logged_relse(bp);
+}
+
 // set bmap's blockno's bit to i (0 / 1)
 void bmap_block_statue_set(uint blockno, int i) {
 #ifdef DEBUG
@@ -73,13 +107,7 @@ void bmap_block_statue_set(uint blockno, int i) {
     bits_flag &= ~(((u_char)1) << bit);
   }
   bmap_cache.cache_buf[byte] = bits_flag;
-  // write back to disk
-  uint bmapno             = blockno / BPB + MYFUSE_STATE->sb.bmapstart;
-  uint bmap_byte_off      = (blockno % BPB) / 8;
-  struct bcache_buf* bp   = logged_read(bmapno);
-  bp->data[bmap_byte_off] = bits_flag;
-  logged_write(bp);
-  logged_relse(bp);
+  bmap_write_back(blockno, 1);
 }
 
 void init_meta_blocks_bmap() {
@@ -105,77 +133,222 @@ void logged_zero_a_block(uint bno) {
   logged_relse(bp);
 }
 
+void logged_zero_a_data_block(uint bno) {
+  struct bcache_buf* bp = logged_read(bno);
+  memset(bp->data, 0, BSIZE);
+  logged_write_data(bp);
+  logged_relse(bp);
+}
+
 static inline uint bmap2blockno(uint bmapno, uint bmap_cache_index) {
   return bmapno + bmap_cache_index * BPB;
 }
 
-uint block_alloc() {
-  pthread_mutex_lock(&bmap_cache.lock);
-  uint free_cache_index = bmap_cache.first_free_cache;
-  if (free_cache_index < 0) {
-    err_exit("no more free space in disk!");
+// give the freed blocks of the committed transactions back to the
+// allocator, called with bmap_cache.lock held. They are free on disk
+// already, only bmap_cache changes: the op has no room to log the bitmap
+static void release_freed_blocks() {
+  if (freed.n == 0) {
+    return;
   }
-  uint first_free_block = bmap_cache.first_unalloced[free_cache_index];
-  DEBUG_TEST(assert(first_free_block >= 0););
-  // fisrt, get the block
-  uint victim_blockno = bmap2blockno(first_free_block, free_cache_index);
+  uint64_t committed = log_committed_tid();
+  while (freed.n > 0 && freed.q[freed.head].tid <= committed) {
+    uint blockno = freed.q[freed.head].blockno;
+    freed.busy[blockno / 8] &= ~(((u_char)1) << (blockno % 8));
+    freed.head = (freed.head + 1) % freed.cap;
+    freed.n--;
+    bmap_cache_free_locked(blockno);
+  }
+}
+
+static void defer_block_free(uint blockno) {
+  if (freed.n == freed.cap) {
+    uint cap             = freed.cap == 0 ? 1024 : freed.cap * 2;
+    struct freed_block* q = malloc(cap * sizeof(struct freed_block));
+    if (q == NULL) {
+      err_exit("defer_block_free: failed to grow the queue");
+    }
+    for (uint i = 0; i < freed.n; i++) {
+      q[i] = freed.q[(freed.head + i) % freed.cap];
+    }
+    free(freed.q);
+    freed.q    = q;
+    freed.head = 0;
+    freed.cap  = cap;
+  }
+  freed.q[(freed.head + freed.n) % freed.cap].blockno = blockno;
+  freed.q[(freed.head + freed.n) % freed.cap].tid     = log_op_tid();
+  freed.n++;
+  freed.busy[blockno / 8] |= ((u_char)1) << (blockno % 8);
+  // clear it on disk
+  bmap_block_statue_set(blockno, 1);
+}
+
+// the bitmap of the blocks of the cache_index-th bitmap block
+static inline const u_char* bmap_map(uint cache_index) {
+  return (u_char*)bmap_cache.cache_buf + cache_index * BSIZE;
+}
 
-  // second, set the block to alloced
-  DEBUG_TEST(assert(bmap_block_statue_get(victim_blockno) == 0););
-  bmap_block_statue_set(victim_blockno, 1);
+// the first free block from the bit-th of the cache_index-th bitmap block,
+// -1 if there is none
+static int bmap_next_free(uint cache_index, uint bit) {
+  uint next = bitmap_next_zero(bmap_map(cache_index), BPB, bit);
+  return next == BPB ? -1 : (int)next;
+}
 
-  // third, update the cache
-  bmap_cache.n_alloced[free_cache_index]++;
-  if (bmap_cache.n_alloced[free_cache_index] == BPB) {
+// mark the nblocks free blocks from blockno allocated, they are in the same
+// bitmap block. called with bmap_cache.lock held
+static void bmap_alloc_run_locked(uint blockno, uint nblocks) {
+  uint cache_index = blockno / BPB;
+  uint bit         = blockno % BPB;
+  for (uint i = blockno; i < blockno + nblocks; i++) {
+    DEBUG_TEST(assert(bmap_block_statue_get(i) == 0););
+    bmap_cache.cache_buf[i / 8] |= ((u_char)1) << (i % 8);
+  }
+  bmap_write_back(blockno, nblocks);
+
+  bmap_cache.n_alloced[cache_index] += nblocks;
+  int first_unalloced = bmap_cache.first_unalloced[cache_index];
+  if (first_unalloced >= (int)bit && first_unalloced < (int)(bit + nblocks)) {
+    bmap_cache.first_unalloced[cache_index] =
+        bmap_next_free(cache_index, bit + nblocks);
+  }
+  if (bmap_cache.first_unalloced[cache_index] == -1 &&
+      bmap_cache.first_free_cache == cache_index) {
     // this cache is full, find the next one
-    int find                                     = 0;
-    bmap_cache.first_unalloced[free_cache_index] = -1;
+    bmap_cache.first_free_cache = -1;
     for (uint i = 0; i < bmap_cache.n_cache; i++) {
       if (bmap_cache.first_unalloced[i] != -1) {
-        find                        = 1;
         bmap_cache.first_free_cache = i;
         break;
       }
     }
+  }
+}
 
-    if (find == 0) {
-      bmap_cache.first_free_cache = -1;
-      err_exit("no more free space in disk!");
+static uint block_alloc_nozero() {
+  pthread_mutex_lock(&bmap_cache.lock);
+  release_freed_blocks();
+  uint free_cache_index = bmap_cache.first_free_cache;
+  // the disk is full but for blocks waiting for the commit of the
+  // transaction freeing them. Commit it, unless it's the op's own
+  while (free_cache_index == (uint)-1 && freed.n > 0 &&
+         freed.q[freed.head].tid < log_op_tid()) {
+    uint64_t tid = freed.q[freed.head].tid;
+    pthread_mutex_unlock(&bmap_cache.lock);
+    log_sync_tid(tid);
+    pthread_mutex_lock(&bmap_cache.lock);
+    release_freed_blocks();
+    free_cache_index = bmap_cache.first_free_cache;
+  }
+  if (free_cache_index == (uint)-1) {
+    err_exit("no more free space in disk!");
+  }
+  int first_free_block = bmap_cache.first_unalloced[free_cache_index];
+  DEBUG_TEST(assert(first_free_block >= 0););
+  uint victim_blockno = bmap2blockno(first_free_block, free_cache_index);
+  bmap_alloc_run_locked(victim_blockno, 1);
+  pthread_mutex_unlock(&bmap_cache.lock);
+  return victim_blockno;
+}
+
+uint block_alloc() {
+  uint blockno = block_alloc_nozero();
+  logged_zero_a_block(blockno);
+  return blockno;
+}
+
+uint block_alloc_data() {
+  uint blockno = block_alloc_nozero();
+  logged_zero_a_data_block(blockno);
+  return blockno;
+}
+
+// Look for a run of at least min free blocks in the bitmap block
+// cache_index, from its bit-th block. The run is cut to max blocks.
+// @return its first block, 0 if there is none
+static uint bmap_find_run(uint cache_index, uint bit, uint min, uint max,
+                          uint* nblocks) {
+  if (bmap_cache.first_unalloced[cache_index] == -1 ||
+      BPB - bmap_cache.n_alloced[cache_index] < min) {
+    return 0;
+  }
+  if (bit < (uint)bmap_cache.first_unalloced[cache_index]) {
+    bit = bmap_cache.first_unalloced[cache_index];
+  }
+  while (bit < BPB) {
+    int start = bmap_next_free(cache_index, bit);
+    if (start == -1) {
+      break;
     }
-  } else {
-    // find the next free block
-    for (uint i = first_free_block + 1; i < BPB; i++) {
-      if (bmap_block_statue_get(bmap2blockno(i, free_cache_index)) == 0) {
-        bmap_cache.first_unalloced[free_cache_index] = i;
-        break;
-      }
+    uint end = bitmap_next_one(bmap_map(cache_index),
+                               max < BPB - start ? start + max : BPB,
+                               start + 1);
+    if (end - start >= min) {
+      *nblocks = end - start;
+      return bmap2blockno(start, cache_index);
     }
+    bit = end;
   }
+  return 0;
+}
 
-  pthread_mutex_unlock(&bmap_cache.lock);
+uint block_alloc_extent(uint goal, uint min, uint max, uint* nblocks) {
+  DEBUG_TEST(assert(min >= 1 && min <= max););
+  pthread_mutex_lock(&bmap_cache.lock);
+  release_freed_blocks();
+  if (goal >= MYFUSE_STATE->sb.size) {
+    goal = 0;
+  }
+  if (goal == 0 && bmap_cache.first_free_cache != (uint)-1) {
+    goal = bmap2blockno(0, bmap_cache.first_free_cache);
+  }
 
-  // fourth, zero the block and return
-  logged_zero_a_block(victim_blockno);
-  return victim_blockno;
+  // from the goal to the end of the disk, then from the start. the bitmap
+  // block of the goal is scanned again from its start last
+  uint blockno = 0;
+  for (uint i = 0; i <= bmap_cache.n_cache && blockno == 0; i++) {
+    uint cache_index = (goal / BPB + i) % bmap_cache.n_cache;
+    uint bit         = i == 0 ? goal % BPB : 0;
+    blockno = bmap_find_run(cache_index, bit, min, max, nblocks);
+  }
+  if (blockno != 0) {
+    bmap_alloc_run_locked(blockno, *nblocks);
+  }
+  pthread_mutex_unlock(&bmap_cache.lock);
+  return blockno;
 }
 
 void block_free(uint blockno) {
+  // the log must not replay what it holds of the block over its next owner
+  log_revoke(blockno);
   pthread_mutex_lock(&bmap_cache.lock);
-  uint cache_index = blockno / BPB;
-  uint bmapno      = blockno % BPB;
+  release_freed_blocks();
+  if (log_data_mode == LOG_DATA_ORDERED) {
+    DEBUG_TEST(assert(bmap_block_statue_get(blockno) == 1); /* double free */);
+    defer_block_free(blockno);
+  } else {
+    block_free_locked(blockno);
+  }
+  pthread_mutex_unlock(&bmap_cache.lock);
+}
 
-  // first, set the block to free
+static void block_free_locked(uint blockno) {
   DEBUG_TEST(assert(bmap_block_statue_get(blockno) == 1); /* double free */);
-  bmap_block_statue_set(blockno, 0);
+  bmap_cache_free_locked(blockno);
+  bmap_write_back(blockno, 1);
+}
 
-  // second, set the cache
+// set the block free in bmap_cache only
+static void bmap_cache_free_locked(uint blockno) {
+  uint cache_index = blockno / BPB;
+  uint bmapno      = blockno % BPB;
+
+  bmap_cache.cache_buf[blockno / 8] &= ~(((u_char)1) << (blockno % 8));
   bmap_cache.n_alloced[cache_index]--;
   bmap_cache.first_unalloced[cache_index] =
       bmap_cache.first_unalloced[cache_index] > bmapno
           ? bmapno
           : bmap_cache.first_unalloced[cache_index];
   bmap_cache.first_free_cache = cache_index;
-
-  pthread_mutex_unlock(&bmap_cache.lock);
-  return;
 }
\ No newline at end of file
@@ -1,18 +1,26 @@
 #include "block_device.h"
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/uio.h>
 #include "util.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024  // linux's, limits.h hides it in strict c11
+#endif
+
 // NOTE: after the read and write need be protected by locks as after the lseek
 // before the write the read-write position may be changed by other threads
 static pthread_mutex_t disk_lock;
 
 static int device_fd;
+// the device holding the log, device_fd unless it's external
+static int journal_fd;
 
 static int write_block_raw_byfd(int fd, uint block_id, const u_char *buf) {
 #ifdef DEBUG
-  if (MYFUSE_STATE != NULL) {
+  if (MYFUSE_STATE != NULL && fd == device_fd) {
     if (block_id >= MYFUSE_STATE->sb.size) {
       err_exit("write out side of disk");
     }
@@ -33,7 +41,7 @@ int write_block_raw(uint block_id, const u_char *buf) {
 
 static int read_block_raw_byfd(int fd, uint block_id, u_char *buf) {
 #ifdef DEBUG
-  if (MYFUSE_STATE != NULL) {
+  if (MYFUSE_STATE != NULL && fd == device_fd) {
     if (block_id >= MYFUSE_STATE->sb.size) {
       err_exit("read out side of disk");
     }
@@ -55,7 +63,7 @@ int read_block_raw(uint block_id, u_char *buf) {
 static int read_block_raw_nbytes_byfd(int fd, uint block_id, u_char *buf,
                                       uint nbytes) {
 #ifdef DEBUG
-  if (MYFUSE_STATE != NULL) {
+  if (MYFUSE_STATE != NULL && fd == device_fd) {
     if (block_id > MYFUSE_STATE->sb.size) {
       err_exit("read out side of disk");
     }
@@ -77,10 +85,141 @@ int read_block_raw_nbytes(uint block_id, u_char *buf, uint nbytes) {
   return read_block_raw_nbytes_byfd(device_fd, block_id, buf, nbytes);
 }
 
+static int write_blocks_raw_byfd(int fd, uint block_id, const u_char *buf,
+                                 uint nblocks) {
+#ifdef DEBUG
+  if (MYFUSE_STATE != NULL && fd == device_fd) {
+    if (block_id + nblocks > MYFUSE_STATE->sb.size) {
+      err_exit("write out side of disk");
+    }
+  }
+#endif
+  pthread_mutex_lock(&disk_lock);
+  if (lseek(fd, (off_t)block_id * BSIZE, SEEK_SET) !=
+      (off_t)block_id * BSIZE) {
+    pthread_mutex_unlock(&disk_lock);
+    return -1;
+  }
+  int nbytes = write(fd, buf, nblocks * BSIZE);
+  pthread_mutex_unlock(&disk_lock);
+  return nbytes;
+}
+
+int write_blocks_raw(uint block_id, const u_char *buf, uint nblocks) {
+  return write_blocks_raw_byfd(device_fd, block_id, buf, nblocks);
+}
+
+static int write_blocks_vec_raw_byfd(int fd, uint block_id,
+                                     const u_char *const *bufs, uint nblocks) {
+#ifdef DEBUG
+  if (MYFUSE_STATE != NULL && fd == device_fd) {
+    if (block_id + nblocks > MYFUSE_STATE->sb.size) {
+      err_exit("write out side of disk");
+    }
+  }
+#endif
+  // positional writes don't move the shared offset, so they don't take
+  // disk_lock: several threads may write at once
+  struct iovec iov[IOV_MAX];
+  int nbytes = 0;
+  for (uint done = 0; done < nblocks;) {
+    uint n = nblocks - done < IOV_MAX ? nblocks - done : IOV_MAX;
+    for (uint i = 0; i < n; i++) {
+      iov[i].iov_base = (void *)bufs[done + i];
+      iov[i].iov_len  = BSIZE;
+    }
+    ssize_t nwrite = pwritev(fd, iov, n, (off_t)(block_id + done) * BSIZE);
+    if (nwrite < 0) {
+      return -1;
+    }
+    nbytes += nwrite;
+    if (nwrite != (ssize_t)n * BSIZE) {
+      break;
+    }
+    done += n;
+  }
+  return nbytes;
+}
+
+int write_blocks_vec_raw(uint block_id, const u_char *const *bufs,
+                         uint nblocks) {
+  return write_blocks_vec_raw_byfd(device_fd, block_id, bufs, nblocks);
+}
+
+static ssize_t read_blocks_raw_byfd(int fd, uint block_id, u_char *buf,
+                                    uint nblocks) {
+#ifdef DEBUG
+  if (MYFUSE_STATE != NULL && fd == device_fd) {
+    if (block_id + nblocks > MYFUSE_STATE->sb.size) {
+      err_exit("read out side of disk");
+    }
+  }
+#endif
+  pthread_mutex_lock(&disk_lock);
+  if (lseek(fd, (off_t)block_id * BSIZE, SEEK_SET) !=
+      (off_t)block_id * BSIZE) {
+    pthread_mutex_unlock(&disk_lock);
+    return -1;
+  }
+  // a read stops short at about 2 GiB, and may on any device
+  size_t len    = (size_t)nblocks * BSIZE;
+  size_t nbytes = 0;
+  while (nbytes < len) {
+    ssize_t nread = read(fd, buf + nbytes, len - nbytes);
+    if (nread < 0) {
+      pthread_mutex_unlock(&disk_lock);
+      return -1;
+    }
+    if (nread == 0) {
+      break;
+    }
+    nbytes += nread;
+  }
+  pthread_mutex_unlock(&disk_lock);
+  return nbytes;
+}
+
+ssize_t read_blocks_raw(uint block_id, u_char *buf, uint nblocks) {
+  return read_blocks_raw_byfd(device_fd, block_id, buf, nblocks);
+}
+
+int journal_write_block_raw(uint block_id, const u_char *buf) {
+  return write_block_raw_byfd(journal_fd, block_id, buf);
+}
+
+int journal_read_block_raw(uint block_id, u_char *buf) {
+  return read_block_raw_byfd(journal_fd, block_id, buf);
+}
+
+ssize_t journal_read_blocks_raw(uint block_id, u_char *buf, uint nblocks) {
+  return read_blocks_raw_byfd(journal_fd, block_id, buf, nblocks);
+}
+
+int journal_write_blocks_vec_raw(uint block_id, const u_char *const *bufs,
+                                 uint nblocks) {
+  return write_blocks_vec_raw_byfd(journal_fd, block_id, bufs, nblocks);
+}
+
+int block_device_flush() { return fdatasync(device_fd); }
+
+int block_device_flush_journal() { return fdatasync(journal_fd); }
+
 void block_device_init(const char *path_to_device) {
   device_fd = open(path_to_device, O_RDWR);
   if (device_fd < 0) {
     err_exit("failed to open disk %s", path_to_device);
   }
+  journal_fd = device_fd;
   pthread_mutex_init(&disk_lock, NULL);
 }
+
+void block_device_init_journal(const char *path) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    err_exit("failed to open journal %s", path);
+  }
+  if (journal_fd != device_fd) {
+    close(journal_fd);
+  }
+  journal_fd = fd;
+}
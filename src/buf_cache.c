@@ -5,18 +5,26 @@
 #include "block_device.h"
 #include "assert.h"
 #include "sys/time.h"
+#include <sys/mman.h>
+#include <stddef.h>
 
 struct bcache_hashtbl {
   pthread_spinlock_t lock;
   struct bcache_buf head;
 };
 
+_Static_assert(offsetof(struct bcache_buf, lock) == CACHE_LINE_SIZE,
+               "bcache_buf hot fields must fit in one cache line");
+
 struct bcache {
   struct bcache_buf buf[NCACHE_BUF];
+  u_char* arena;  // NCACHE_BUF * BSIZE, page aligned, buf[i] owns the i-th
 
   pthread_mutex_t lock;
 
   struct bcache_hashtbl hash[BCACHE_HASH_SIZE];
+
+  uint nresident;  // number of buffers holding data
 };
 
 static struct bcache bcache;
@@ -24,25 +32,82 @@ static struct bcache bcache;
 void bcache_init() {
   struct bcache_buf* b;
 
+  // pages are only backed once touched, and given back by bcache_shrink()
+  bcache.arena = mmap(NULL, NCACHE_BUF * BSIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bcache.arena == MAP_FAILED) {
+    err_exit("bcache_init: failed to map the data arena");
+  }
+
   for (int i = 0; i < BCACHE_HASH_SIZE; i++) {
     pthread_spin_init(&bcache.hash[i].lock, PTHREAD_PROCESS_SHARED);
     bcache.hash[i].head.prev = &bcache.hash[i].head;
     bcache.hash[i].head.next = &bcache.hash[i].head;
   }
 
-  // add all buffers to hash[0]
+  // spread the buffers over the buckets, a bucket only recycles its own
+  // buffers as long as it has an unreferenced one
+  int hashid = 0;
   for (b = bcache.buf; b < bcache.buf + NCACHE_BUF; b++) {
-    b->next = bcache.hash[0].head.next;
-    b->prev = &bcache.hash[0].head;
+    struct bcache_hashtbl* bucket = &bcache.hash[hashid];
+    b->blockno                    = hashid;
+    b->data                       = bcache.arena + (b - bcache.buf) * BSIZE;
+    b->next                       = bucket->head.next;
+    b->prev                       = &bucket->head;
     pthread_mutex_init(&b->lock, NULL);
-    bcache.hash[0].head.next->prev = b;
-    bcache.hash[0].head.next       = b;
+    bucket->head.next->prev = b;
+    bucket->head.next       = b;
+    hashid                  = (hashid + 1) % BCACHE_HASH_SIZE;
   }
 }
 
 static uint bcache_hash(uint blockno) { return blockno % BCACHE_HASH_SIZE; }
 
-static struct bcache_buf* bget(uint blockno) {
+// Per-thread front cache of the bufs this thread got recently, a FUSE op
+// usually breads the same few blocks again and again (the inode block in
+// ilock and iupdate...).
+// An entry is only a hint: b may have been recycled for another block since.
+// It's checked under the lock of blockno's bucket, which is held by whoever
+// moves a buf to or from blockno, so b->blockno == blockno can't change
+// while we hold it.
+struct bfront_entry {
+  uint blockno;
+  struct bcache_buf* b;
+};
+static __thread struct bfront_entry bfront[NBFRONT];
+static __thread uint bfront_next;
+
+// Return a locked buf if the front cache has blockno, or 0
+static struct bcache_buf* bfront_lookup(uint blockno) {
+  for (int i = 0; i < NBFRONT; i++) {
+    struct bcache_buf* b = bfront[i].b;
+    if (b == 0 || bfront[i].blockno != blockno) {
+      continue;
+    }
+
+    struct bcache_hashtbl* bucket = &bcache.hash[bcache_hash(blockno)];
+    pthread_spin_lock(&bucket->lock);
+    if (__atomic_load_n(&b->blockno, __ATOMIC_RELAXED) == blockno) {
+      b->refcnt++;
+      pthread_spin_unlock(&bucket->lock);
+      pthread_mutex_lock(&b->lock);
+      return b;
+    }
+    pthread_spin_unlock(&bucket->lock);
+    // recycled
+    bfront[i].b = 0;
+    return 0;
+  }
+  return 0;
+}
+
+static void bfront_insert(uint blockno, struct bcache_buf* b) {
+  bfront[bfront_next].blockno = blockno;
+  bfront[bfront_next].b       = b;
+  bfront_next                 = (bfront_next + 1) % NBFRONT;
+}
+
+static struct bcache_buf* bget_slow(uint blockno) {
   struct bcache_buf* b;
 
   int hashid                    = bcache_hash(blockno);
@@ -65,26 +130,26 @@ static struct bcache_buf* bget(uint blockno) {
   // Recycle per hashtbl and get the least recent buf
 
   struct bcache_buf* least_recent_buf = 0;
+  uint64_t least_recent_time_stamp    = 0;
+  least_recent_time_stamp--;
   for (b = bcache.hash[hashid].head.prev; b != &bcache.hash[hashid].head;
        b = b->prev) {
-    uint64_t least_recent_time_stamp = 0;
-    least_recent_time_stamp--;
     if (b->refcnt == 0) {
       if (b->timestamp <= least_recent_time_stamp) {
         least_recent_buf        = b;
         least_recent_time_stamp = b->timestamp;
       }
     }
+  }
 
-    if (least_recent_buf) {
-      b          = least_recent_buf;
-      b->blockno = blockno;
-      b->refcnt  = 1;
-      b->valid   = 0;
-      pthread_spin_unlock(&bucket->lock);
-      pthread_mutex_lock(&b->lock);
-      return b;
-    }
+  if (least_recent_buf) {
+    b          = least_recent_buf;
+    b->blockno = blockno;
+    b->refcnt  = 1;
+    b->valid   = 0;
+    pthread_spin_unlock(&bucket->lock);
+    pthread_mutex_lock(&b->lock);
+    return b;
   }
 
   int hidx;
@@ -140,11 +205,66 @@ static struct bcache_buf* bget(uint blockno) {
   return b;
 }
 
+// Look blockno up without recycling a buffer for it.
+// Return a locked buf, or 0 if blockno isn't cached
+static struct bcache_buf* blookup(uint blockno) {
+  struct bcache_buf* b;
+
+  int hashid                    = bcache_hash(blockno);
+  struct bcache_hashtbl* bucket = &bcache.hash[hashid];
+  pthread_spin_lock(&bucket->lock);
+  for (b = bucket->head.next; b != &bucket->head; b = b->next) {
+    if (b->blockno == blockno) {
+      b->refcnt++;
+      pthread_spin_unlock(&bucket->lock);
+      pthread_mutex_lock(&b->lock);
+      return b;
+    }
+  }
+  pthread_spin_unlock(&bucket->lock);
+  return 0;
+}
+
+int bread_cached(uint blockno, u_char* dst) {
+  struct bcache_buf* b = blookup(blockno);
+  int hit              = 0;
+  if (b == 0) {
+    return 0;
+  }
+  if (b->valid) {
+    memmove(dst, b->data, BSIZE);
+    hit = 1;
+  }
+  brelse(b);
+  return hit;
+}
+
+void binvalidate(uint blockno) {
+  struct bcache_buf* b = blookup(blockno);
+  if (b != 0) {
+    b->valid = 0;
+    brelse(b);
+  }
+}
+
+static struct bcache_buf* bget(uint blockno) {
+  struct bcache_buf* b = bfront_lookup(blockno);
+  if (b == 0) {
+    b = bget_slow(blockno);
+    bfront_insert(blockno, b);
+  }
+  return b;
+}
+
 struct bcache_buf* bread(uint blockno) {
   struct bcache_buf* b;
 
   b = bget(blockno);
   if (!b->valid) {
+    if (!b->resident) {
+      b->resident = 1;
+      __atomic_add_fetch(&bcache.nresident, 1, __ATOMIC_RELAXED);
+    }
     read_block_raw(blockno, b->data);
     b->valid = 1;
   }
@@ -163,7 +283,7 @@ static inline uint64_t current_timestamp() {
   struct timeval te;
   gettimeofday(&te, NULL);  // get current time
   long long milliseconds =
-      te.tv_sec * 100LL + te.tv_usec / 100;  // calculate milliseconds
+      te.tv_sec * 1000LL + te.tv_usec / 1000;  // calculate milliseconds
   return milliseconds;
 }
 
@@ -187,6 +307,10 @@ void brelse(struct bcache_buf* b) {
   pthread_spin_unlock(&bucket->lock);
 }
 
+u_char* bcache_page(struct bcache_buf* b) {
+  return bcache.arena + (b - bcache.buf) * BSIZE;
+}
+
 void bpin(struct bcache_buf* b) {
   int hashid                    = bcache_hash(b->blockno);
   struct bcache_hashtbl* bucket = &bcache.hash[hashid];
@@ -202,3 +326,117 @@ void bunpin(struct bcache_buf* b) {
   b->refcnt--;
   pthread_spin_unlock(&bucket->lock);
 }
+
+void bprefetch(uint blockno) {
+  struct bcache_buf* b = bread(blockno);
+  brelse(b);
+}
+
+uint bcache_nresident() {
+  return __atomic_load_n(&bcache.nresident, __ATOMIC_RELAXED);
+}
+
+static int timestamp_cmp(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+uint bcache_shrink(uint nbuf) {
+  uint nresident = bcache_nresident();
+  if (nresident <= nbuf) {
+    return 0;
+  }
+
+  // first pass, find the timestamp cut off of the ones to release
+  uint64_t* timestamps = malloc(sizeof(uint64_t) * NCACHE_BUF);
+  uint ncandidate      = 0;
+  if (timestamps == NULL) {
+    return 0;
+  }
+  for (int i = 0; i < BCACHE_HASH_SIZE; i++) {
+    struct bcache_hashtbl* bucket = &bcache.hash[i];
+    pthread_spin_lock(&bucket->lock);
+    for (struct bcache_buf* b = bucket->head.next; b != &bucket->head;
+         b = b->next) {
+      if (b->refcnt == 0 && b->resident) {
+        timestamps[ncandidate++] = b->timestamp;
+      }
+    }
+    pthread_spin_unlock(&bucket->lock);
+  }
+  uint nrelease = nresident - nbuf;
+  if (nrelease > ncandidate) {
+    nrelease = ncandidate;
+  }
+  if (nrelease == 0) {
+    free(timestamps);
+    return 0;
+  }
+  qsort(timestamps, ncandidate, sizeof(uint64_t), timestamp_cmp);
+  uint64_t cut_off = timestamps[nrelease - 1];
+  free(timestamps);
+
+  // second pass, release them.
+  // a buf with refcnt 0 is neither used nor waited for, and being
+  // unreferenced it's clean: dirty bufs are pinned by the log
+  uint nreleased = 0;
+  for (int i = 0; i < BCACHE_HASH_SIZE && nreleased < nrelease; i++) {
+    struct bcache_hashtbl* bucket = &bcache.hash[i];
+    pthread_spin_lock(&bucket->lock);
+    for (struct bcache_buf* b = bucket->head.next;
+         b != &bucket->head && nreleased < nrelease; b = b->next) {
+      if (b->refcnt == 0 && b->resident && b->timestamp <= cut_off) {
+        madvise(b->data, BSIZE, MADV_DONTNEED);
+        b->resident = 0;
+        b->valid    = 0;
+        nreleased++;
+      }
+    }
+    pthread_spin_unlock(&bucket->lock);
+  }
+  __atomic_sub_fetch(&bcache.nresident, nreleased, __ATOMIC_RELAXED);
+  return nreleased;
+}
+
+struct bcache_hot {
+  uint64_t timestamp;
+  uint blockno;
+};
+
+// most recently used first
+static int hot_cmp(const void* a, const void* b) {
+  uint64_t x = ((const struct bcache_hot*)a)->timestamp;
+  uint64_t y = ((const struct bcache_hot*)b)->timestamp;
+  return x > y ? -1 : x < y;
+}
+
+uint bcache_hot_blocks(uint* blocknos, uint max) {
+  struct bcache_hot* hot = malloc(sizeof(struct bcache_hot) * NCACHE_BUF);
+  uint nhot              = 0;
+  if (hot == NULL) {
+    return 0;
+  }
+
+  for (int i = 0; i < BCACHE_HASH_SIZE; i++) {
+    struct bcache_hashtbl* bucket = &bcache.hash[i];
+    pthread_spin_lock(&bucket->lock);
+    for (struct bcache_buf* b = bucket->head.next; b != &bucket->head;
+         b = b->next) {
+      if (b->valid) {
+        hot[nhot].timestamp = b->timestamp;
+        hot[nhot].blockno   = b->blockno;
+        nhot++;
+      }
+    }
+    pthread_spin_unlock(&bucket->lock);
+  }
+  qsort(hot, nhot, sizeof(struct bcache_hot), hot_cmp);
+
+  uint n = nhot < max ? nhot : max;
+  for (uint i = 0; i < n; i++) {
+    blocknos[i] = hot[i].blockno;
+  }
+  free(hot);
+  return n;
+}
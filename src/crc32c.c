@@ -0,0 +1,84 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+// reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+// crc32c_table[k][i] is the crc of byte i followed by k zero bytes
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const u_char* p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const u_char* p, size_t len) {
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+  }
+  for (; len > 0; len--) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc, const u_char* p, size_t len) {
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  uint64_t crc64 = crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; len > 0; len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+static void crc32c_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (int k = 1; k < 8; k++) {
+    for (int i = 0; i < 256; i++) {
+      uint32_t prev      = crc32c_table[k - 1][i];
+      crc32c_table[k][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+    }
+  }
+
+  crc32c_impl = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_impl = crc32c_hw;
+  }
+#endif
+}
+
+uint crc32c(uint crc, const void* buf, size_t len) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_impl(~crc, buf, len);
+}
@@ -10,6 +10,16 @@
 
 #define NFILE_INIT 50
 
+// Log blocks the ops reserve, see begin_op_reserve().
+// An op which may free an inode (and all of its blocks) uses begin_op().
+// Read-only ops (lookups, reads, stats) don't begin any, see
+// inode_read_nbytes_locked() and iput().
+//
+// dirlink(): the inode and an entry block of the directory, and a new entry
+// block with up to 3 indirect ones, each a bitmap block and the block zeroed,
+// linked from its parent
+#define DIRLINK_NBLOCKS (2 + 4 * 2 + 3)
+
 struct ftable {
   pthread_spinlock_t lock;
   struct file **files;
@@ -25,6 +35,27 @@ void ftable_grow() {
   }
 }
 
+uint ftable_shrink() {
+  pthread_spin_lock(&ftable.lock);
+  uint nkeep  = 0;
+  uint nfreed = 0;
+  for (uint i = 0; i < ftable.nfile; i++) {
+    struct file *f = ftable.files[i];
+    if (f->ref > 0 || nkeep < NFILE_INIT) {
+      ftable.files[nkeep++] = f;
+    } else {
+      free(f);
+      nfreed++;
+    }
+  }
+  if (nfreed != 0) {
+    ftable.files = realloc(ftable.files, nkeep * sizeof(struct file *));
+    ftable.nfile = nkeep;
+  }
+  pthread_spin_unlock(&ftable.lock);
+  return nfreed;
+}
+
 void file_init() {
   ftable.files = malloc(sizeof(struct file *) * NFILE_INIT);
   ftable.nfile = NFILE_INIT;
@@ -78,18 +109,14 @@ void fileclose(struct file *f) {
   f->ref           = 0;
   pthread_spin_unlock(&ftable.lock);
 
-  begin_op();
   iput(ip);
-  end_op();
 }
 
 int filestat(struct file *f, struct stat *stbuf) {
   if (f->type == FD_INODE) {
-    begin_op();
     ilock(f->ip);
     int res = stat_inode(f->ip, stbuf);
     iunlock(f->ip);
-    end_op();
     return res;
   } else {
     err_exit("filestat: unknown file type");
@@ -101,20 +128,17 @@ int filestat(struct file *f, struct stat *stbuf) {
 int myfuse_getattr(const char *path, struct stat *stbuf,
                    struct fuse_file_info *fi) {
   (void)fi;
-  begin_op();
   struct inode *ip = path2inode(path);
   int res          = 0;
 
   if (ip == NULL) {
     myfuse_debug_log("`%s' is not exist", path);
-    end_op();
     res = -ENOENT;
     return res;
   }
   ilock(ip);
   res = stat_inode(ip, stbuf);
   iunlockput(ip);
-  end_op();
 
   return res;
 }
@@ -125,11 +149,9 @@ int myfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   if (fi == NULL) {
     return -ENOENT;
   }
-  begin_op();
   struct inode *dp = ((struct file *)fi->fh)->ip;
   if (dp == NULL) {
     myfuse_debug_log("`%s' is not exist", path);
-    end_op();
     return -ENOENT;
   }
 
@@ -145,14 +167,12 @@ int myfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   DEBUG_TEST(if (dp->type != T_DIR_INODE_MYFUSE) {
     free(dirbuf);
     iunlock(dp);
-    end_op();
     return -EBADF;
   });
 
   if (inode_read_nbytes_locked(dp, dirbuf, dp->size, 0) != dp->size) {
     free(dirbuf);
     iunlock(dp);
-    end_op();
     err_exit("dirlookup: failed to read dir");
   }
 
@@ -178,22 +198,18 @@ int myfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
   iunlock(dp);
   free(dirbuf);
-  end_op();
 
   return 0;
 }
 
 int myfuse_opendir(const char *path, struct fuse_file_info *fi) {
-  begin_op();
   struct inode *dir_inode = path2inode(path);
   if (dir_inode == NULL) {
-    end_op();
     return -ENOENT;
   }
   ilock(dir_inode);
   if (dir_inode->type != T_DIR_INODE_MYFUSE) {
     iunlockput(dir_inode);
-    end_op();
     return -ENOTDIR;
   }
   struct file *file = filealloc();
@@ -202,15 +218,19 @@ int myfuse_opendir(const char *path, struct fuse_file_info *fi) {
   fi->fh            = (size_t)file;
   DEBUG_TEST(if (file->ip->ref < 1) { err_exit("myfuse_opendir: ref < 1"); });
   iunlock(dir_inode);
-  end_op();
   return 0;
 }
 
 int myfuse_open(const char *path, struct fuse_file_info *fi) {
-  begin_op();
+  // only creating the file logs
+  int create = (fi->flags & O_CREAT) != 0;
+  if (create) {
+    // the new inode, the directory's and dirlink()
+    begin_op_reserve(2 + DIRLINK_NBLOCKS);
+  }
   struct inode *file_inode = path2inode(path);
   if (file_inode == NULL) {
-    if ((fi->flags & O_CREAT) == 0) {
+    if (!create) {
       return -ENOENT;
     } else {
       // create the file
@@ -250,7 +270,9 @@ int myfuse_open(const char *path, struct fuse_file_info *fi) {
 
   fi->fh = (size_t)file;
   iunlock(file_inode);
-  end_op();
+  if (create) {
+    end_op();
+  }
   return 0;
 }
 
@@ -280,7 +302,8 @@ int myfuse_mkdir(const char *path, mode_t mode) {
   int res = 0;
   char name[DIRSIZE];
 
-  begin_op();
+  // the new inode (freed again if the name exists) and dirlink()
+  begin_op_reserve(3 + DIRLINK_NBLOCKS);
 
   struct inode *dp = path2parentinode(path, name);
 
@@ -433,6 +456,30 @@ int myfuse_write(const char *path, const char *buf, size_t size, off_t offset,
   return nbytes;
 }
 
+// Commits are asynchronous: fsync waits for the transaction of the last
+// change to the file, or to its contents with datasync, and commits it at
+// once. The fsyncs waiting for the same transaction share its commit.
+int myfuse_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  struct file *file = fi != NULL ? (struct file *)fi->fh : NULL;
+  if (file != NULL) {
+    inode_sync(file->ip, datasync);
+    return 0;
+  }
+  struct inode *ip = path2inode(path);
+  if (ip == NULL) {
+    return -ENOENT;
+  }
+  inode_sync(ip, datasync);
+  iput(ip);
+  return 0;
+}
+
+// the entries of a directory are its contents
+int myfuse_fsyncdir(const char *path, int datasync,
+                    struct fuse_file_info *fi) {
+  return myfuse_fsync(path, datasync, fi);
+}
+
 int myfuse_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
   (void)fi;
   begin_op();
@@ -456,13 +503,11 @@ int myfuse_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
 
 int myfuse_access(const char *path, int mask) {
   (void)mask;
-  begin_op();
   struct inode *ip = path2inode(path);
   if (ip == NULL) {
     return -ENOENT;
   }
   iput(ip);
-  end_op();
 
   return 0;
 }
@@ -474,7 +519,8 @@ int myfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     err_exit("must be regular file");
   }
 
-  begin_op();
+  // the new inode, the directory's and dirlink()
+  begin_op_reserve(2 + DIRLINK_NBLOCKS);
   // create the file
   char filename[DIRSIZE];
   struct inode *dir_inode = path2parentinode(path, filename);
@@ -523,9 +569,10 @@ int myfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 
 int myfuse_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
   (void)fi;
-  begin_op();
+  begin_op_reserve(1);
   struct inode *ip = path2inode(path);
   if (ip == NULL) {
+    end_op();
     return -ENOENT;
   }
 
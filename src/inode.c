@@ -5,6 +5,7 @@
 #include <errno.h>
 #include "log.h"
 #include "block_allocator.h"
+#include "block_device.h"
 
 struct {
   pthread_spinlock_t lock;
@@ -45,6 +46,35 @@ static void itable_grow() {
   }
 }
 
+// Free the unreferenced itable entries and give the memory back, the table
+// keeps at least NINODE_INIT entries.
+// An entry with ref 0 is neither locked nor pointed to by anyone.
+// @return the number of entries freed
+uint itable_shrink() {
+  pthread_spin_lock(&itable.lock);
+  size_t nkeep = 0;
+  uint nfreed  = 0;
+  for (size_t i = 0; i < itable.ninode; i++) {
+    struct inode* ip = itable.inode[i];
+    if (ip->ref > 0 || nkeep < NINODE_INIT) {
+      itable.inode[nkeep++] = ip;
+    } else {
+      pthread_mutex_destroy(&ip->lock);
+      free(ip);
+      nfreed++;
+    }
+  }
+  if (nfreed != 0) {
+    itable.inode  = realloc(itable.inode, sizeof(struct inode*) * nkeep);
+    itable.ninode = nkeep;
+  }
+  pthread_spin_unlock(&itable.lock);
+  if (nfreed != 0) {
+    myfuse_debug_log("itable_shrink: %d entries freed", nfreed);
+  }
+  return nfreed;
+}
+
 // return the {inum}-th inode's in memory copy
 // the inode isn't locked and haven't read from disk
 struct inode* iget(uint inum) {
@@ -87,7 +117,7 @@ struct inode* ialloc(short type) {
     if (dip->type == T_UNUSE_INODE_MYFUSE) {
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
-      logged_write(bp);
+      logged_write_range(bp, (u_char*)dip - bp->data, sizeof(*dip));
       logged_relse(bp);
       return iget(inum);
     }
@@ -135,7 +165,10 @@ void ilock(struct inode* ip) {
     ip->st_ctimespec = dip->st_ctimespec;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     logged_relse(bp);
-    ip->valid = 1;
+    // it may have been changed by a transaction not committed yet
+    ip->sync_tid     = log_running_tid();
+    ip->datasync_tid = ip->sync_tid;
+    ip->valid        = 1;
     if (ip->type == T_UNUSE_INODE_MYFUSE) {
       err_exit("ilock: ip is unused");
     }
@@ -165,8 +198,14 @@ void iupdate(struct inode* ip) {
   struct bcache_buf* bp;
   struct dinode* dip;
 
-  bp                = logged_read(IBLOCK(ip->inum));
-  dip               = (struct dinode*)bp->data + ip->inum % IPB;
+  bp  = logged_read(IBLOCK(ip->inum));
+  dip = (struct dinode*)bp->data + ip->inum % IPB;
+  // fdatasync skips the changes of the times or the permissions alone
+  if (dip->size != ip->size ||
+      memcmp(dip->addrs, ip->addrs, sizeof(ip->addrs)) != 0) {
+    ip->datasync_tid = log_op_tid();
+  }
+  ip->sync_tid      = log_op_tid();
   dip->type         = ip->type;
   dip->major        = ip->major;
   dip->minor        = ip->minor;
@@ -178,7 +217,7 @@ void iupdate(struct inode* ip) {
   get_current_timespec(&ip->st_ctimespec);
   dip->st_ctimespec = ip->st_ctimespec;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-  logged_write(bp);
+  logged_write_range(bp, (u_char*)dip - bp->data, sizeof(*dip));
   logged_relse(bp);
 }
 void itrunc(struct inode* ip);
@@ -188,12 +227,19 @@ void itrunc(struct inode* ip);
 // be recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
-// All calls to iput() must be inside a transaction in
-// case it has to free the inode.
+// Freeing it needs a transaction: a read-only op (outside of any) begins
+// one for it.
 void iput(struct inode* ip) {
   pthread_spin_lock(&itable.lock);
 
   if (ip->ref == 1 && ip->valid && ip->nlink == 0) {
+    if (log_op_tid() == 0) {
+      pthread_spin_unlock(&itable.lock);
+      begin_op();
+      iput(ip);
+      end_op();
+      return;
+    }
     // truncate and free
 
     pthread_mutex_lock(&ip->lock);
@@ -216,12 +262,6 @@ void iunlockput(struct inode* ip) {
   iput(ip);
 }
 
-static inline void assert_no_need_to_restart_op_in_imap2blockno() {
-  if (n_log_wrote >= MAXOPBLOCKS - 1 - 3) {
-    err_exit("too many blocks in one op");
-  }
-}
-
 // Inode content
 //
 // The content (data) associated with each inode is stored
@@ -233,15 +273,35 @@ static inline void assert_no_need_to_restart_op_in_imap2blockno() {
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 
-uint imap2blockno(struct inode* ip, uint bn) {
-  assert_no_need_to_restart_op_in_imap2blockno();
+// The blocks of a regular file hold data, written in place in ordered mode.
+// The ones of a directory are metadata, always logged.
+static uint inode_block_alloc(struct inode* ip) {
+  return ip->type == T_FILE_INODE_MYFUSE ? block_alloc_data() : block_alloc();
+}
+
+// the block to map a hole to: data_addr if one was allocated for it, or a
+// new one
+static uint inode_hole_block(struct inode* ip, uint data_addr) {
+  return data_addr != 0 ? data_addr : inode_block_alloc(ip);
+}
 
+static void inode_logged_write(struct inode* ip, struct bcache_buf* bp) {
+  if (ip->type == T_FILE_INODE_MYFUSE) {
+    logged_write_data(bp);
+  } else {
+    logged_write(bp);
+  }
+}
+
+// map the bn-th block of ip, to data_addr if it's a hole and data_addr isn't
+// 0
+static uint imap2blockno_map(struct inode* ip, uint bn, uint data_addr) {
   uint addr, *a;
   struct bcache_buf* bp;
 
   if (bn < NDIRECT) {
     if ((addr = ip->addrs[bn]) == 0) {
-      ip->addrs[bn] = addr = block_alloc();
+      ip->addrs[bn] = addr = inode_hole_block(ip, data_addr);
     }
     return addr;
   }
@@ -259,7 +319,7 @@ uint imap2blockno(struct inode* ip, uint bn) {
     bp = logged_read(addr);
     a  = (uint*)bp->data;
     if ((addr = a[bn]) == 0) {
-      a[bn] = addr = block_alloc();
+      a[bn] = addr = inode_hole_block(ip, data_addr);
       logged_write(bp);
     }
     logged_relse(bp);
@@ -292,7 +352,7 @@ uint imap2blockno(struct inode* ip, uint bn) {
     bp = logged_read(addr);
     a  = (uint*)bp->data;
     if ((addr = a[offset]) == 0) {
-      a[offset] = addr = block_alloc();
+      a[offset] = addr = inode_hole_block(ip, data_addr);
       logged_write(bp);
     }
     logged_relse(bp);
@@ -338,7 +398,7 @@ uint imap2blockno(struct inode* ip, uint bn) {
     bp = logged_read(addr);
     a  = (uint*)bp->data;
     if ((addr = a[offsetl2]) == 0) {
-      a[offsetl2] = addr = block_alloc();
+      a[offsetl2] = addr = inode_hole_block(ip, data_addr);
       logged_write(bp);
     }
     logged_relse(bp);
@@ -349,6 +409,86 @@ uint imap2blockno(struct inode* ip, uint bn) {
   return -1;
 }
 
+uint imap2blockno(struct inode* ip, uint bn) {
+  return imap2blockno_map(ip, bn, 0);
+}
+
+uint imap2blockno_lookup(struct inode* ip, uint bn) {
+  if (bn < NDIRECT) {
+    return ip->addrs[bn];
+  }
+  bn -= NDIRECT;
+
+  // the indirect block and how many levels lead to the data block
+  uint addr;
+  int nlevel;
+  if (bn < NINDIRECT1) {
+    addr   = ip->addrs[NDIRECT];
+    nlevel = 1;
+  } else if ((bn -= NINDIRECT1) < NINDIRECT2) {
+    addr   = ip->addrs[NDIRECT + 1];
+    nlevel = 2;
+  } else if ((bn -= NINDIRECT2) < NINDIRECT3) {
+    addr   = ip->addrs[NDIRECT + 2];
+    nlevel = 3;
+  } else {
+    err_exit("imap2blockno_lookup: inode too big");
+    return 0;
+  }
+
+  // a level maps NINDIRECT1 times more blocks than the next one
+  uint span = 1;
+  for (int level = 1; level < nlevel; level++) {
+    span *= NINDIRECT1;
+  }
+  for (; addr != 0 && span != 0; span /= NINDIRECT1) {
+    struct bcache_buf* bp = logged_read(addr);
+    addr                  = ((uint*)bp->data)[bn / span % NINDIRECT1];
+    logged_relse(bp);
+  }
+  return addr;
+}
+
+// Allocate the holes among the nblocks blocks of ip from the bn-th as
+// contiguous runs, each after the block before it. A run as long as the hole
+// is taken from anywhere rather than filling small free gaps.
+static void inode_alloc_blocks(struct inode* ip, uint bn, uint nblocks) {
+  uint i = 0;
+  while (i < nblocks) {
+    if (imap2blockno_lookup(ip, bn + i) != 0) {
+      i++;
+      continue;
+    }
+    uint nhole = 1;
+    while (i + nhole < nblocks &&
+           imap2blockno_lookup(ip, bn + i + nhole) == 0) {
+      nhole++;
+    }
+    uint goal = bn + i > 0 ? imap2blockno_lookup(ip, bn + i - 1) : 0;
+    if (goal != 0) {
+      goal++;
+    }
+
+    uint n;
+    uint addr = block_alloc_extent(goal, nhole, nhole, &n);
+    if (addr == 0 && (addr = block_alloc_extent(goal, 1, nhole, &n)) == 0) {
+      // the disk is full, imap2blockno() reports it
+      (void)imap2blockno(ip, bn + i);
+      i++;
+      continue;
+    }
+    for (uint j = 0; j < n; j++) {
+      if (ip->type == T_FILE_INODE_MYFUSE) {
+        logged_zero_a_data_block(addr + j);
+      } else {
+        logged_zero_a_block(addr + j);
+      }
+      imap2blockno_map(ip, bn + i + j, addr + j);
+    }
+    i += n;
+  }
+}
+
 void itrunc(struct inode* ip) {
   myfuse_debug_log("itrunc");
   for (int i = 0; i < NDIRECT; i++) {
@@ -425,7 +565,8 @@ void itrunc(struct inode* ip) {
 }
 
 void itrunc2size_log_op_restart_helper() {
-  if (n_log_wrote >= MAXOPBLOCKS - 1 - 3) {
+  // 3 is the max imap2blockno will write
+  if (log_op_room() <= 1 + 3 && !log_extend_op(MAXOPBLOCKS)) {
     end_op();
     begin_op();
   }
@@ -437,7 +578,6 @@ void itrunc2size_log_op_restart_helper() {
   (x) = 0;
 
 void imap2blockno_free(struct inode* ip, uint bn) {
-  assert_no_need_to_restart_op_in_imap2blockno();
 
   uint addr, *a;
   struct bcache_buf* bp;
@@ -455,7 +595,7 @@ void imap2blockno_free(struct inode* ip, uint bn) {
   //           |
   //           +---> [d d .. d]
   if (bn < NINDIRECT1) {
-    // Load indirect block, allocating if necessary.
+    // Load indirect block
     if ((addr = ip->addrs[NDIRECT]) == 0) {
       return;
     }
@@ -479,9 +619,9 @@ void imap2blockno_free(struct inode* ip, uint bn) {
   if (bn < NINDIRECT2) {
     uint entry  = bn / NINDIRECT1;
     uint offset = bn % NINDIRECT1;
-    // Load indirect entry, allocating if necessary
+    // Load indirect entry, a free never allocates
     if ((addr = ip->addrs[NDIRECT + 1]) == 0) {
-      ip->addrs[NDIRECT + 1] = addr = block_alloc();
+      return;
     }
     bp = logged_read(addr);
     a  = (uint*)bp->data;
@@ -516,9 +656,8 @@ void imap2blockno_free(struct inode* ip, uint bn) {
     uint offsetl1 = bn % NINDIRECT2;
     uint entryl2  = offsetl1 / NINDIRECT1;
     uint offsetl2 = offsetl1 % NINDIRECT1;
-    // Load indirect entry, allocating if necessary
+    // Load indirect entry
     if ((addr = ip->addrs[NDIRECT + 2]) == 0) {
-      // exit
       return;
     }
     bp = logged_read(addr);
@@ -553,6 +692,37 @@ void imap2blockno_free(struct inode* ip, uint bn) {
   return;
 }
 
+static size_t min(size_t a, size_t b) { return a < b ? a : b; }
+
+// make sure the op can log nneed more blocks, extend it or end it and begin
+// another one (up to MAXOPBLOCKS)
+static void restart_op_on(struct inode* ip, int nneed) {
+  int room = log_op_room();
+  if (room >= nneed || log_extend_op(nneed - room)) {
+    return;
+  }
+  // the inode goes with what the op wrote so far
+  iupdate(ip);
+  iunlock(ip);
+  end_op();
+  begin_op_reserve(nneed);
+  ilock(ip);
+}
+
+// log blocks writing nblocks blocks of ip from the bn-th may take: the inode,
+// each block (logged, or zeroed when allocated) and the bitmap block of its
+// allocation, and the indirect blocks on the way with theirs.
+// Up to NINDIRECT1 contiguous blocks go through 5 indirect blocks at most,
+// a single one through 3.
+static int inode_write_nblocks_need(struct inode* ip, uint bn, uint nblocks) {
+  if (nblocks == 1 && imap2blockno_lookup(ip, bn) != 0) {
+    // the block is there, as for most directory entries written within a
+    // bigger op
+    return 1 + 1;
+  }
+  return 1 + 2 * nblocks + 2 * (nblocks == 1 ? 3 : 5);
+}
+
 // called inside op and lock
 int itrunc2size(struct inode* ip, size_t size) {
   DEBUG_TEST(if (ip->type != T_FILE_INODE_MYFUSE) {
@@ -573,17 +743,21 @@ int itrunc2size(struct inode* ip, size_t size) {
   long long origin_blockno = ROUNDUP(ip->size, BSIZE) / BSIZE;
   myfuse_debug_log("%lx truncate to %lx, %lx", ip->size, size, nbytes_aligned);
 
-  if (target_blockno >= origin_blockno) {
-    for (uint i = origin_blockno; i < target_blockno; i++) {
-      // alloc the node
-      itrunc2size_log_op_restart_helper();
-      (void)imap2blockno(ip, i);
-    }
-  } else {
-    for (uint i = target_blockno; i < origin_blockno; i++) {
-      itrunc2size_log_op_restart_helper();
-      imap2blockno_free(ip, i);
-    }
+  // Growing may restart the op, unlocking ip meanwhile (holding it while
+  // waiting in begin_op() could keep its transaction from closing). The
+  // size only changes at the end, others see ip as before: the blocks
+  // allocated past it are read by nobody. An op writing past the size
+  // meanwhile may leave ip bigger than size, it's cut as a shrink then
+  for (uint i = origin_blockno; i < target_blockno;
+       i += INODE_WRITE_CHUNK_NBLOCKS) {
+    uint nblocks = min(INODE_WRITE_CHUNK_NBLOCKS, target_blockno - i);
+    restart_op_on(ip, inode_write_nblocks_need(ip, i, nblocks));
+    inode_alloc_blocks(ip, i, nblocks);
+  }
+  origin_blockno = ROUNDUP(ip->size, BSIZE) / BSIZE;
+  for (uint i = target_blockno; i < origin_blockno; i++) {
+    itrunc2size_log_op_restart_helper();
+    imap2blockno_free(ip, i);
   }
 
 out:
@@ -594,87 +768,203 @@ out:
 }
 #undef block_free
 
-static size_t min(size_t a, size_t b) { return a < b ? a : b; }
+size_t bypass_cache_threshold = BYPASS_CACHE_THRESHOLD;
+
+// Write nblocks full blocks from data to ip, starting from the
+// inode_blockno-th block, behind the buffer cache.
+// Physically contiguous blocks are written with one request. A block logged
+// by a transaction not installed yet still goes through the log, as its
+// cached copy will be installed at commit.
+static void inode_write_blocks_uncached(struct inode* ip, const char* data,
+                                        uint inode_blockno, uint nblocks) {
+  uint run_start       = 0;
+  uint run_len         = 0;
+  const char* run_data = NULL;
+  struct bcache_buf* bp;
 
-static void restart_op_on(struct inode* ip, uint nwrote) {
-  // iupdate will write the inode to disk, so we need to
-  // reserve the op
-  if (n_log_wrote >= nwrote - 1) {
-    iupdate(ip);
-    iunlock(ip);
-    end_op();
-    begin_op();
-    ilock(ip);
+  for (uint i = 0; i <= nblocks; i++) {
+    uint addr = 0;
+    if (i < nblocks) {
+      addr = imap2blockno(ip, inode_blockno + i);
+      if (log_block_pending(addr)) {
+        bp = logged_read(addr);
+        memmove(bp->data, data + i * BSIZE, BSIZE);
+        inode_logged_write(ip, bp);
+        logged_relse(bp);
+        continue;
+      }
+      if (run_len != 0 && addr == run_start + run_len) {
+        run_len++;
+        continue;
+      }
+    }
+
+    // flush the current run
+    if (run_len != 0) {
+      if (write_blocks_raw(run_start, (const u_char*)run_data, run_len) !=
+          run_len * BSIZE) {
+        err_exit("inode_write_blocks_uncached: write failed");
+      }
+      // write then invalidate, so a racing reader can't cache the old data
+      for (uint j = 0; j < run_len; j++) {
+        binvalidate(run_start + j);
+      }
+    }
+    run_start = addr;
+    run_len   = 1;
+    run_data  = data + i * BSIZE;
   }
 }
 
-long inode_write_nbytes_locked(struct inode* ip, const char* data,
-                               size_t nbytes, size_t off) {
-  if (off > MAXFILE_SIZE) {
-    return 0;
-  }
+// Read nblocks full blocks from ip to data, starting from the
+// inode_blockno-th block, behind the buffer cache.
+// A cached copy is used if there is one (it may be newer than the disk),
+// physically contiguous blocks not cached are read with one request.
+static void inode_read_blocks_uncached(struct inode* ip, char* data,
+                                       uint inode_blockno, uint nblocks) {
+  uint run_start = 0;
+  uint run_len   = 0;
+  char* run_data = NULL;
+
+  for (uint i = 0; i <= nblocks; i++) {
+    uint addr = 0;
+    if (i < nblocks) {
+      addr = imap2blockno_lookup(ip, inode_blockno + i);
+      if (addr != 0 && bread_cached(addr, (u_char*)data + i * BSIZE)) {
+        continue;
+      }
+      if (addr != 0 && run_len != 0 && addr == run_start + run_len) {
+        run_len++;
+        continue;
+      }
+    }
 
-  if (off + nbytes > MAXFILE_SIZE) {
-    nbytes -= (off + nbytes - MAXFILE_SIZE);
+    // flush the current run
+    if (run_len != 0) {
+      if (read_blocks_raw(run_start, (u_char*)run_data, run_len) !=
+          run_len * BSIZE) {
+        err_exit("inode_read_blocks_uncached: read failed");
+      }
+      run_len = 0;
+    }
+    if (addr == 0) {
+      // a hole (or the end)
+      if (i < nblocks) {
+        memset(data + i * BSIZE, 0, BSIZE);
+      }
+      continue;
+    }
+    run_start = addr;
+    run_len   = 1;
+    run_data  = data + i * BSIZE;
   }
+}
 
-  long n_write = nbytes;
-
-  // update size
-  ip->size = ip->size < off + nbytes ? off + nbytes : ip->size;
-  iupdate(ip);
+// file contents are journaled in LOG_DATA_JOURNAL mode, never written in
+// place
+static inline int should_bypass_cache(size_t nbytes) {
+  return log_data_mode != LOG_DATA_JOURNAL && bypass_cache_threshold != 0 &&
+         nbytes >= bypass_cache_threshold;
+}
 
-  uint inode_block_start = ((size_t)(off / BSIZE));
-  size_t from_start      = off % BSIZE;
-  size_t n_left          = BSIZE - from_start;
-  restart_op_on(ip, MAXOPBLOCKS - 1 - 3 - 1);
-  struct bcache_buf* bp = logged_read(imap2blockno(ip, inode_block_start));
-  memmove(bp->data + from_start, data, min(n_left, nbytes));
-  logged_write(bp);
+// write n bytes from data at off of the bn-th block of ip
+static void inode_write_block(struct inode* ip, uint bn, const char* data,
+                              size_t off, size_t n) {
+  struct bcache_buf* bp = logged_read(imap2blockno(ip, bn));
+  memmove(bp->data + off, data, n);
+  inode_logged_write(ip, bp);
   logged_relse(bp);
-  if (nbytes <= n_left) {
-    get_current_timespec(&ip->st_atimespec);
-    ip->st_mtimespec = ip->st_atimespec;
-    iupdate(ip);
-    return nbytes;
+}
+
+// write a chunk of nbytes from data to ip at off, the op has room for it.
+// The partial blocks at both ends go through the cache
+static void inode_write_chunk(struct inode* ip, const char* data,
+                              size_t nbytes, size_t off, int bypass) {
+  uint inode_blockno = off / BSIZE;
+  size_t from_start  = off % BSIZE;
+  if (from_start != 0 || nbytes < BSIZE) {
+    size_t n = min(BSIZE - from_start, nbytes);
+    inode_write_block(ip, inode_blockno, data, from_start, n);
+    data += n;
+    nbytes -= n;
+    inode_blockno++;
   }
-  nbytes -= n_left;
-  data += n_left;
 
-  // start block write
-  uint inode_blockno = inode_block_start + 1;
-  for (; nbytes > BSIZE; nbytes -= BSIZE) {
-    // 3 is the max imap2blockno will write
-    // 1 is the followed write
-    restart_op_on(ip, MAXOPBLOCKS - 1 - 3 - 1);
+  uint nfull_blocks = nbytes / BSIZE;
+  if (bypass) {
+    inode_write_blocks_uncached(ip, data, inode_blockno, nfull_blocks);
+  } else {
+    for (uint i = 0; i < nfull_blocks; i++) {
+      inode_write_block(ip, inode_blockno + i, data + i * BSIZE, 0, BSIZE);
+    }
+  }
+  data += nfull_blocks * BSIZE;
+  nbytes -= nfull_blocks * BSIZE;
+  inode_blockno += nfull_blocks;
 
-    bp = logged_read(imap2blockno(ip, inode_blockno));
-    memmove(bp->data, data, BSIZE);
-    logged_write(bp);
-    logged_relse(bp);
+  if (nbytes) {
+    inode_write_block(ip, inode_blockno, data, 0, nbytes);
+  }
+}
 
-    data += BSIZE;
-    inode_blockno++;
+long inode_write_nbytes_locked(struct inode* ip, const char* data,
+                               size_t nbytes, size_t off) {
+  if (off > MAXFILE_SIZE) {
+    return 0;
   }
 
-  // 3 is the max imap2blockno will write
-  // 1 is the followed write
-  restart_op_on(ip, MAXOPBLOCKS - 3 - 1);
+  if (off + nbytes > MAXFILE_SIZE) {
+    nbytes -= (off + nbytes - MAXFILE_SIZE);
+  }
 
-  // write last block
-  if (nbytes) {
-    bp = logged_read(imap2blockno(ip, inode_blockno));
-    memmove(bp->data, data, nbytes);
-    logged_write(bp);
-    logged_relse(bp);
+  long n_write = nbytes;
+  // decided once for the whole write, from the full blocks it covers
+  size_t full_start = ROUNDUP(off, BSIZE);
+  size_t full_end   = ROUNDDOWN(off + nbytes, BSIZE);
+  int bypass =
+      full_end > full_start && should_bypass_cache(full_end - full_start);
+
+  while (nbytes > 0) {
+    size_t from_start = off % BSIZE;
+    size_t n = min(nbytes, INODE_WRITE_CHUNK_NBLOCKS * BSIZE - from_start);
+    uint nblocks = (from_start + n + BSIZE - 1) / BSIZE;
+    restart_op_on(ip, inode_write_nblocks_need(ip, off / BSIZE, nblocks));
+    if (nblocks > 1) {
+      inode_alloc_blocks(ip, off / BSIZE, nblocks);
+    }
+    inode_write_chunk(ip, data, n, off, bypass);
+    // logged with the chunk, a crash keeps a prefix of the write
+    if (ip->size < off + n) {
+      ip->size = off + n;
+    }
+    data += n;
+    off += n;
+    nbytes -= n;
   }
 
   get_current_timespec(&ip->st_atimespec);
   ip->st_mtimespec = ip->st_atimespec;
+  ip->datasync_tid = log_op_tid();
   iupdate(ip);
   return n_write;
 }
 
+// read n bytes at off of the bn-th block of ip, a hole reads as zeros
+static void inode_read_block(struct inode* ip, uint bn, char* data,
+                             size_t off, size_t n) {
+  uint addr = imap2blockno_lookup(ip, bn);
+  if (addr == 0) {
+    memset(data, 0, n);
+    return;
+  }
+  struct bcache_buf* bp = logged_read(addr);
+  memmove(data, bp->data + off, n);
+  logged_relse(bp);
+}
+
+// Reads log nothing, they can be done outside of an op: no block is
+// allocated for a hole, and the access time is only updated in memory, to
+// be written by the next iupdate() of the inode.
 long inode_read_nbytes_locked(struct inode* ip, char* data, size_t nbytes,
                               size_t off) {
   if (off > ip->size) {
@@ -689,12 +979,10 @@ long inode_read_nbytes_locked(struct inode* ip, char* data, size_t nbytes,
   uint inode_block_start = ((size_t)(off / BSIZE));
   size_t from_start      = off % BSIZE;
   size_t n_left          = BSIZE - from_start;
-  struct bcache_buf* bp  = logged_read(imap2blockno(ip, inode_block_start));
-  memmove(data, bp->data + from_start, min(n_left, nbytes));
-  logged_relse(bp);
+  inode_read_block(ip, inode_block_start, data, from_start,
+                   min(n_left, nbytes));
   if (nbytes <= n_left) {
     get_current_timespec(&ip->st_atimespec);
-    iupdate(ip);
     return nbytes;
   }
   nbytes -= n_left;
@@ -702,31 +990,38 @@ long inode_read_nbytes_locked(struct inode* ip, char* data, size_t nbytes,
 
   // start block write
   uint inode_blockno = inode_block_start + 1;
+  uint nfull_blocks  = (nbytes - 1) / BSIZE;
+  if (should_bypass_cache(nfull_blocks * BSIZE)) {
+    inode_read_blocks_uncached(ip, data, inode_blockno, nfull_blocks);
+    data += nfull_blocks * BSIZE;
+    nbytes -= nfull_blocks * BSIZE;
+    inode_blockno += nfull_blocks;
+  }
   for (; nbytes > BSIZE; nbytes -= BSIZE) {
-    // 3 is the max imap2blockno will write
-    restart_op_on(ip, MAXOPBLOCKS - 1 - 3);
-
-    bp = logged_read(imap2blockno(ip, inode_blockno));
-    memmove(data, bp->data, BSIZE);
-    logged_relse(bp);
+    inode_read_block(ip, inode_blockno, data, 0, BSIZE);
     data += BSIZE;
     inode_blockno++;
   }
 
-  // write last block
+  // read last block
   if (nbytes) {
-    // 3 is the max imap2blockno will write
-    restart_op_on(ip, MAXOPBLOCKS - 1 - 3);
-    bp = logged_read(imap2blockno(ip, inode_blockno));
-    memmove(data, bp->data, nbytes);
-    logged_relse(bp);
+    inode_read_block(ip, inode_blockno, data, 0, nbytes);
   }
-  iupdate(ip);
 
   get_current_timespec(&ip->st_atimespec);
   return n_read;
 }
 
+void inode_sync(struct inode* ip, int datasync) {
+  ilock(ip);
+  uint64_t tid = ip->datasync_tid;
+  if (!datasync && ip->sync_tid > tid) {
+    tid = ip->sync_tid;
+  }
+  iunlock(ip);
+  log_sync_tid(tid);
+}
+
 long inode_write_nbytes_unlocked(struct inode* ip, const char* data,
                                  size_t bytes, size_t off) {
   begin_op();
@@ -739,11 +1034,9 @@ long inode_write_nbytes_unlocked(struct inode* ip, const char* data,
 
 long inode_read_nbytes_unlocked(struct inode* ip, char* data, size_t bytes,
                                 size_t off) {
-  begin_op();
   ilock(ip);
   long nbytes = inode_read_nbytes_locked(ip, data, bytes, off);
   iunlock(ip);
-  end_op();
   return nbytes;
 }
 
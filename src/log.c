@@ -1,12 +1,68 @@
 #include "log.h"
+#include "block_device.h"
 #include "buf_cache.h"
+#include "crc32c.h"
 #include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
-struct fslogheader {
+// log blocks taken by nbytes
+#define LOG_NBLOCKS(nbytes) ((int)(((nbytes) + BSIZE - 1) / BSIZE))
+// bytes of the descriptor of n blocks logged whole or revoked, without delta
+// records
+#define LOG_DESC_SIZE(n) \
+  (offsetof(struct fslogheader, block) + (n) * sizeof(uint))
+// blocks taken by the descriptor of n blocks logged whole or revoked
+#define LOG_DESC_NBLOCKS(n) LOG_NBLOCKS(LOG_DESC_SIZE(n))
+// log blocks taken by a transaction of n blocks at most, whichever of them
+// are delta records (one is smaller than a block). It revokes
+// LOG_MAX_NBLOCKS blocks at most, the ones the log holds
+#define LOG_TRANS_NBLOCKS(n) (LOG_DESC_NBLOCKS((n) + LOG_MAX_NBLOCKS) + (n))
+// bytes of the delta record of len bytes
+#define LOG_DELTA_SIZE(len) ((sizeof(struct fslogdelta) + (len) + 3) & ~3ul)
+// bytes of the largest descriptor
+#define LOG_DESC_MAX_SIZE                                        \
+  (LOG_DESC_SIZE(LOG_MAX_NBLOCKS) +                              \
+   LOG_MAX_NBLOCKS * LOG_DELTA_SIZE(LOG_DELTA_MAX_NBYTES))
+_Static_assert(LOG_DELTA_SIZE(LOG_DELTA_MAX_NBYTES) <= BSIZE,
+               "a delta record bigger than the block");
+
+// the recovery installs the blocks with up to that many threads, each
+// writing at least LOG_RECOVERY_THREAD_NBLOCKS
+#define LOG_RECOVERY_NTHREADS 4
+#define LOG_RECOVERY_THREAD_NBLOCKS 256
+// the recovery reads the log that many blocks at a time, the most a
+// transaction may take
+#define LOG_RECOVERY_NBLOCKS \
+  (LOG_TRANS_NBLOCKS(LOG_MAX_NBLOCKS) + LOG_NBLOCKS(LOG_DESC_MAX_SIZE))
+
+// open addressing hash from blockno to its index in blockset.block,
+// kept at most half full
+#define LOG_HASH_BITS 11
+#define LOG_HASH_SIZE (1 << LOG_HASH_BITS)
+_Static_assert(LOG_HASH_SIZE >= 2 * LOG_MAX_NBLOCKS, "log hash too small");
+
+struct blockset {
   int n;
-  int block[NLOG];
+  uint block[LOG_MAX_NBLOCKS];
+  int slot[LOG_HASH_SIZE];  // index in block + 1, 0 if empty
+};
+
+struct transaction {
+  uint64_t tid;
+  struct blockset blocks;
+  // the bytes of blocks.block[i] the transaction changed are from
+  // dirty_start[i] to dirty_end[i]
+  uint16_t dirty_start[LOG_MAX_NBLOCKS];
+  uint16_t dirty_end[LOG_MAX_NBLOCKS];
+  // blocks freed by the transaction, revoked.block[i] only if
+  // revoke_active[i]: a block logged again is written whole instead
+  struct blockset revoked;
+  u_char revoke_active[LOG_MAX_NBLOCKS];
+  struct blockset ordered;      // data blocks written in place before commit
+  struct timespec first_write;  // when the transaction got dirty
+  struct log_commit_stats stats;  // filled along, recorded once committed
 };
 
 // log's in memory representation
@@ -15,172 +71,1351 @@ struct fslog {
   int start;
   int size;
   int outstanding;  // how many FS sys calls are executing
-  int committing;   // in commit(), please wait
-  struct fslogheader lh;
+  int reserved;     // blocks the executing ones may still log
+  int closing;      // the running transaction is closed, please wait
   pthread_cond_t wakeup;  // for the pthread_cond_wait
+
+  // the running transaction takes new ops while the committing one
+  // (if any) is written by the journal thread
+  struct transaction trans[2];
+  struct transaction* running;
+  struct transaction* committing;
+
+  // the log is circular, committed transactions live between tail and head.
+  // positions count blocks since the log was created, position pos is in
+  // log block 1 + pos % nslot
+  uint nslot;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t tail_tid;
+  // blocks committed but not installed at their home location yet,
+  // each pinned once in the cache until the next checkpoint.
+  // checkpoint.block[i] was logged last by transaction checkpoint_ltid[i]
+  // and revoked last by checkpoint_rtid[i] (0 if none): a block revoked
+  // since it was logged is dead, the checkpoint doesn't install it
+  struct blockset checkpoint;
+  uint64_t checkpoint_ltid[LOG_MAX_NBLOCKS];
+  uint64_t checkpoint_rtid[LOG_MAX_NBLOCKS];
+
+  pthread_t journal;              // the journal thread, runs every commit()
+  pthread_cond_t journal_wakeup;  // wakes the journal thread up
+  int nwaiting;                   // begin_op() waiting for log space
+  int nforce;                     // callers waiting for a commit
+  int nforce_checkpoint;          // callers waiting for a checkpoint
+  uint64_t committed_tid;         // transactions up to it are on disk
+  uint64_t checkpointed_tid;      // transactions up to it are installed
+
+  // the commit records, the last one at (stats.ncommit - 1) %
+  // LOG_STATS_NRECORD, and the checkpoint run since, recorded with the next
+  struct log_commit_stats stats_ring[LOG_STATS_NRECORD];
+  struct log_stats stats;
+  uint checkpoint_ninstall;
+  uint64_t checkpoint_us;
 };
 
 struct fslog fslog;
 
+int log_data_mode          = LOG_DATA_ORDERED;
+int log_commit_interval_ms = LOG_COMMIT_INTERVAL_MS;
+
+// the transaction the op of this thread joined in
+static __thread uint64_t op_tid;
+// blocks the op of this thread reserved and didn't log yet
+static __thread int op_reserved;
+
 static void recover_from_log();
-static void commit();
+static void* journal_thread(void* arg);
 
 void log_init(struct superblock* sb) {
-  if (sizeof(struct fslogheader) > BSIZE) {
-    err_exit("log_init: too big logheader");
+  if (sb->nlog < NLOG_MIN) {
+    err_exit("log_init: too small log");
+  }
+  if (sb->journal != 0) {
+    // the external journal must be the one made with the file system
+    static u_char buf[BSIZE];
+    struct journal_header* jh = (struct journal_header*)buf;
+    if (journal_read_block_raw(JOURNAL_HEADER_ID, buf) != BSIZE ||
+        jh->magic != JOURNAL_MAGIC || jh->fsmagic != FSMAGIC ||
+        jh->id != sb->journal || jh->nlog < sb->nlog) {
+      err_exit("log_init: not the journal of the file system");
+    }
   }
 
   pthread_mutex_init(&fslog.lock, NULL);
   fslog.start = sb->logstart;
   fslog.size  = sb->nlog;
+  fslog.nslot = sb->nlog - 1;
   pthread_cond_init(&fslog.wakeup, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&fslog.journal_wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+  fslog.running    = &fslog.trans[0];
+  fslog.committing = 0;
+  memset(&fslog.running->stats, 0, sizeof(fslog.running->stats));
   recover_from_log();
+
+  if (pthread_create(&fslog.journal, NULL, journal_thread, NULL) != 0) {
+    err_exit("log_init: failed to create the journal thread");
+  }
+}
+
+static uint log_blockno(uint64_t pos) {
+  return fslog.start + 1 + pos % fslog.nslot;
+}
+
+static uint log_hash(uint blockno) {
+  return (blockno * 2654435761u) >> (32 - LOG_HASH_BITS);
+}
+
+// Return the hash entry of blockno in s, or the empty one to put it in
+static int* blockset_lookup(struct blockset* s, uint blockno) {
+  uint h = log_hash(blockno);
+  while (s->slot[h] != 0 && s->block[s->slot[h] - 1] != blockno) {
+    h = (h + 1) & (LOG_HASH_SIZE - 1);
+  }
+  return &s->slot[h];
+}
+
+static int blockset_contains(struct blockset* s, uint blockno) {
+  return *blockset_lookup(s, blockno) != 0;
+}
+
+// add blockno to s, its index in s->block is put in *index
+// @return 1 if blockno wasn't in s
+static int blockset_add_index(struct blockset* s, uint blockno, int* index) {
+  int* slot = blockset_lookup(s, blockno);
+  if (*slot != 0) {
+    *index = *slot - 1;
+    return 0;
+  }
+  s->block[s->n] = blockno;
+  s->n++;
+  *slot  = s->n;
+  *index = s->n - 1;
+  return 1;
+}
+
+// @return 1 if blockno wasn't in s
+static int blockset_add(struct blockset* s, uint blockno) {
+  int index;
+  return blockset_add_index(s, blockno, &index);
+}
+
+static void blockset_clear(struct blockset* s) {
+  s->n = 0;
+  memset(s->slot, 0, sizeof(s->slot));
+}
+
+static int blockno_cmp(const void* a, const void* b) {
+  uint x = *(const uint*)a;
+  uint y = *(const uint*)b;
+  return x < y ? -1 : x > y;
+}
+
+// copy the blocks of s to blocks, in ascending order
+static void blockset_sorted(struct blockset* s, uint* blocks) {
+  memmove(blocks, s->block, s->n * sizeof(blocks[0]));
+  qsort(blocks, s->n, sizeof(blocks[0]), blockno_cmp);
 }
 
-static void install_transaction(int recovering) {
-  for (int tail = 0; tail < fslog.lh.n; tail++) {
-    struct bcache_buf* log_buf =
-        bread(fslog.start + tail + 1);                         // read log block
-    struct bcache_buf* dst_buf = bread(fslog.lh.block[tail]);  // read dst
-    memcpy(dst_buf->data, log_buf->data, BSIZE);
-    bwrite(dst_buf);
-    if (recovering == 0) {
-      bunpin(dst_buf);
+static int transaction_empty(struct transaction* t) {
+  return t->blocks.n == 0 && t->revoked.n == 0 && t->ordered.n == 0;
+}
+
+// did t revoke blockno, after logging it if it did?
+static int transaction_revoked(struct transaction* t, uint blockno) {
+  int slot = *blockset_lookup(&t->revoked, blockno);
+  return slot != 0 && t->revoke_active[slot - 1];
+}
+
+// is a committed block revoked, not to be installed? called with fslog.lock
+// held, or by the journal thread
+static int checkpoint_dead(uint blockno) {
+  int slot = *blockset_lookup(&fslog.checkpoint, blockno);
+  return slot != 0 &&
+         fslog.checkpoint_rtid[slot - 1] > fslog.checkpoint_ltid[slot - 1];
+}
+
+// is t->blocks.block[i] logged as a delta record?
+static int transaction_delta(struct transaction* t, int i) {
+  return t->dirty_end[i] - t->dirty_start[i] <= LOG_DELTA_MAX_NBYTES;
+}
+
+// Drop the transactions before tail_tid from the log, once the blocks they
+// logged are installed. The installed blocks are flushed first: the log
+// mustn't forget them before they are on stable storage.
+static void write_log_super(uint64_t tail, uint64_t tail_tid) {
+  static u_char buf[BSIZE];
+  struct fslogsuper* ls = (struct fslogsuper*)buf;
+  ls->magic             = LOG_MAGIC;
+  ls->tail              = tail;
+  ls->tail_tid          = tail_tid;
+  if (block_device_flush() != 0) {
+    err_exit("write_log_super: failed to flush the disk");
+  }
+  if (journal_write_block_raw(fslog.start, buf) != BSIZE ||
+      block_device_flush_journal() != 0) {
+    err_exit("write_log_super: failed to write the log");
+  }
+}
+
+// the crc of the descriptor lh, to be continued with its blocks
+static uint log_desc_crc(struct fslogheader* lh) {
+  uint crc = lh->crc;
+  lh->crc  = 0;
+  uint sum = crc32c(0, lh, lh->size);
+  lh->crc  = crc;
+  return sum;
+}
+
+// read n log blocks from pos, which may wrap around the end of the log.
+// log blocks are read behind the cache, it never holds them
+static void read_log_blocks(uint64_t pos, u_char* buf, uint n) {
+  uint first = fslog.nslot - pos % fslog.nslot;
+  if (first > n) {
+    first = n;
+  }
+  if (journal_read_blocks_raw(log_blockno(pos), buf, first) !=
+          (int)(first * BSIZE) ||
+      journal_read_blocks_raw(log_blockno(pos + first), buf + first * BSIZE,
+                              n - first) != (int)((n - first) * BSIZE)) {
+    err_exit("read_log_blocks: failed to read the log");
+  }
+}
+
+// may lh be the descriptor of transaction tid, its blocks in the next
+// nblocks log blocks? its crc is yet to check
+static int log_desc_valid(struct fslogheader* lh, uint64_t tid,
+                          uint64_t nblocks) {
+  // an empty transaction is never written
+  return lh->magic == LOG_MAGIC && lh->tid == tid && lh->n >= 0 &&
+         lh->nrevoke >= 0 && lh->ndelta >= 0 &&
+         (uint64_t)lh->n + lh->nrevoke + lh->ndelta > 0 &&
+         lh->size >= LOG_DESC_SIZE((uint64_t)lh->n + lh->nrevoke) &&
+         LOG_NBLOCKS((uint64_t)lh->size) + (uint64_t)lh->n <= nblocks;
+}
+
+// a block logged by a replayed transaction, whole or as a delta, or revoked
+struct replayed_block {
+  uint blockno;
+  uint seq;  // in the order they were logged
+  uint16_t off;
+  uint16_t len;        // 0 if revoked
+  const u_char* data;  // the len bytes from off
+};
+
+static int replayed_block_whole(const struct replayed_block* r) {
+  return r->off == 0 && r->len == BSIZE;
+}
+
+// the records of the block of r[i], sorted, are r[i] to r[*next - 1].
+// the ones to replay start at *start, after its last revoke
+static void replayed_block_records(const struct replayed_block* r, int n,
+                                   int i, int* start, int* next) {
+  *start = i;
+  for (*next = i; *next < n && r[*next].blockno == r[i].blockno; (*next)++) {
+    if (r[*next].len == 0) {
+      *start = *next + 1;
     }
-    brelse(log_buf);
-    brelse(dst_buf);
   }
 }
 
-static void read_log_header_from_disk() {
-  struct bcache_buf* buf = bread(fslog.start);
-  struct fslogheader* lh = (struct fslogheader*)(buf->data);
+// by blockno, then as logged
+static int replayed_block_cmp(const void* a, const void* b) {
+  const struct replayed_block* x = a;
+  const struct replayed_block* y = b;
+  if (x->blockno != y->blockno) {
+    return x->blockno < y->blockno ? -1 : 1;
+  }
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
 
-  fslog.lh.n = lh->n;
-  for (int i = 0; i < fslog.lh.n; i++) {
-    fslog.lh.block[i] = lh->block[i];
+// blocks to write at their home location, sorted
+struct install_range {
+  const uint* blocks;
+  const u_char* const* pages;
+  int n;
+};
+
+// write the blocks of a range, contiguous ones together
+static void* install_blocks(void* arg) {
+  struct install_range* r = arg;
+  for (int i = 0, run = 0; i < r->n; i = run) {
+    for (run = i + 1;
+         run < r->n && r->blocks[run] == r->blocks[run - 1] + 1; run++) {
+    }
+    if (write_blocks_vec_raw(r->blocks[i], r->pages + i, run - i) !=
+        (run - i) * BSIZE) {
+      err_exit("install_blocks: failed to install blocks");
+    }
   }
-  brelse(buf);
+  return NULL;
 }
 
-static void write_log_header_to_disk() {
-  struct bcache_buf* buf = bread(fslog.start);
-  struct fslogheader* lh = (struct fslogheader*)(buf->data);
+// install_blocks() split between up to LOG_RECOVERY_NTHREADS threads
+static void install_blocks_parallel(const uint* blocks,
+                                    const u_char* const* pages, int n) {
+  pthread_t threads[LOG_RECOVERY_NTHREADS];
+  struct install_range ranges[LOG_RECOVERY_NTHREADS];
+  int nthread = n / LOG_RECOVERY_THREAD_NBLOCKS;
+  if (nthread < 1) {
+    nthread = 1;
+  } else if (nthread > LOG_RECOVERY_NTHREADS) {
+    nthread = LOG_RECOVERY_NTHREADS;
+  }
+  for (int i = 0; i < nthread; i++) {
+    int start        = (int64_t)n * i / nthread;
+    ranges[i].blocks = blocks + start;
+    ranges[i].pages  = pages + start;
+    ranges[i].n      = (int64_t)n * (i + 1) / nthread - start;
+  }
+  for (int i = 1; i < nthread; i++) {
+    if (pthread_create(&threads[i], NULL, install_blocks, &ranges[i]) != 0) {
+      err_exit("install_blocks_parallel: failed to create a thread");
+    }
+  }
+  install_blocks(&ranges[0]);
+  for (int i = 1; i < nthread; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
 
-  lh->n = fslog.lh.n;
-  for (int i = 0; i < fslog.lh.n; i++) {
-    lh->block[i] = fslog.lh.block[i];
+// The recovery reads the log in batches of LOG_RECOVERY_NBLOCKS blocks
+// from the tail, each from the first transaction the previous one didn't
+// hold whole, up to the first invalid descriptor.
+struct recovery {
+  u_char* buf;
+  uint64_t buf_pos;  // the log position of buf
+  uint nbuf;         // log blocks in buf
+  // a record is numbered in the order they were logged
+  uint seq;
+  // the blocks revoked, sorted by recover_from_log() after the scan pass
+  struct replayed_block* revoked;
+  int nrevoked;
+  int cap_revoked;
+  // the records of the batch to install
+  struct replayed_block* replayed;
+  int nreplayed;
+  int cap_replayed;
+};
+
+// the transaction tid at pos of the log from tail, if it's valid and whole
+// in the batch, NULL if not. *partial tells if it went past the batch
+static struct fslogheader* recovery_trans(struct recovery* rc, uint64_t tail,
+                                          uint64_t pos, uint64_t tid,
+                                          int* partial) {
+  *partial = pos >= rc->buf_pos + rc->nbuf;
+  if (*partial) {
+    return NULL;
+  }
+  struct fslogheader* lh =
+      (struct fslogheader*)(rc->buf + (pos - rc->buf_pos) * BSIZE);
+  if (!log_desc_valid(lh, tid, fslog.nslot - (pos - tail))) {
+    return NULL;
   }
-  bwrite(buf);
-  brelse(buf);
+  uint64_t end = pos + LOG_NBLOCKS(lh->size) + lh->n;
+  *partial     = end > rc->buf_pos + rc->nbuf;
+  if (*partial) {
+    return NULL;
+  }
+  const u_char* data = (u_char*)lh + LOG_NBLOCKS(lh->size) * BSIZE;
+  if (crc32c(log_desc_crc(lh), data, (size_t)lh->n * BSIZE) != lh->crc) {
+    return NULL;
+  }
+  return lh;
 }
 
+static void recovery_add(struct replayed_block** r, int* n, int* cap,
+                         struct replayed_block record) {
+  if (*n == *cap) {
+    *cap = *cap == 0 ? 1024 : 2 * *cap;
+    *r   = realloc(*r, *cap * sizeof(struct replayed_block));
+    if (*r == NULL) {
+      err_exit("recover_from_log: failed to allocate %d records", *cap);
+    }
+  }
+  (*r)[(*n)++] = record;
+}
+
+// the seq of the last revoke of blockno, -1 if none
+static int64_t recovery_last_revoke(struct recovery* rc, uint blockno) {
+  int lo = 0;
+  int hi = rc->nrevoked;
+  // the first revoke of a block after blockno
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (rc->revoked[mid].blockno <= blockno) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || rc->revoked[lo - 1].blockno != blockno) {
+    return -1;
+  }
+  return rc->revoked[lo - 1].seq;
+}
+
+// the records of transaction lh: the revokes when scanning, the blocks
+// logged since their last revoke when replaying
+static void recovery_records(struct recovery* rc, struct fslogheader* lh,
+                             uint64_t tid, int replay) {
+  const u_char* data = (u_char*)lh + LOG_NBLOCKS(lh->size) * BSIZE;
+  const u_char* p    = (u_char*)lh + LOG_DESC_SIZE(lh->n + lh->nrevoke);
+  const u_char* end  = (u_char*)lh + lh->size;
+  for (int i = 0; i < lh->n + lh->nrevoke + lh->ndelta; i++) {
+    struct replayed_block r;
+    if (i < lh->n) {
+      r = (struct replayed_block){lh->block[i], rc->seq, 0, BSIZE,
+                                  data + i * BSIZE};
+    } else if (i < lh->n + lh->nrevoke) {
+      r = (struct replayed_block){lh->block[i], rc->seq, 0, 0, NULL};
+    } else {
+      const struct fslogdelta* d = (const struct fslogdelta*)p;
+      if (end - p < (long)sizeof(*d) || d->len == 0 ||
+          d->off + d->len > BSIZE || end - p < (long)LOG_DELTA_SIZE(d->len)) {
+        err_exit("recover_from_log: bad delta record in transaction %lu",
+                 tid);
+      }
+      r = (struct replayed_block){d->blockno, rc->seq, d->off, d->len,
+                                  d->data};
+      p += LOG_DELTA_SIZE(d->len);
+    }
+    rc->seq++;
+    if (!replay && r.len == 0) {
+      recovery_add(&rc->revoked, &rc->nrevoked, &rc->cap_revoked, r);
+    } else if (replay && r.len != 0 &&
+               recovery_last_revoke(rc, r.blockno) < (int64_t)r.seq) {
+      recovery_add(&rc->replayed, &rc->nreplayed, &rc->cap_replayed, r);
+    }
+  }
+}
+
+// Install the records of the batch: a block ends up as the last
+// transaction logging it whole left it, with the later delta records on top
+// (or its home location, as the previous batches left it, if none did).
+// A block logged several times is installed once.
+// @return the blocks installed
+static int recovery_install(struct recovery* rc) {
+  struct replayed_block* replayed = rc->replayed;
+  int n                           = rc->nreplayed;
+  qsort(replayed, n, sizeof(replayed[0]), replayed_block_cmp);
+  int nmerge = 0;
+  for (int i = 0, start, next; i < n; i = next) {
+    replayed_block_records(replayed, n, i, &start, &next);
+    if (start < next && !replayed_block_whole(&replayed[next - 1])) {
+      nmerge++;
+    }
+  }
+  uint* blocks         = malloc(n * sizeof(uint));
+  const u_char** pages = malloc(n * sizeof(u_char*));
+  u_char* merged       = malloc((size_t)nmerge * BSIZE);
+  if ((n > 0 && (blocks == NULL || pages == NULL)) ||
+      (merged == NULL && nmerge > 0)) {
+    err_exit("recover_from_log: failed to allocate %d blocks", n);
+  }
+  int ninstall = 0;
+  for (int i = 0, start, next; i < n; i = next) {
+    replayed_block_records(replayed, n, i, &start, &next);
+    if (start == next) {
+      continue;
+    }
+    blocks[ninstall] = replayed[i].blockno;
+    if (replayed_block_whole(&replayed[next - 1])) {
+      pages[ninstall++] = replayed[next - 1].data;
+      continue;
+    }
+    int whole = next - 1;
+    while (whole >= start && !replayed_block_whole(&replayed[whole])) {
+      whole--;
+    }
+    u_char* page = merged + (size_t)--nmerge * BSIZE;
+    if (whole >= start) {
+      memmove(page, replayed[whole].data, BSIZE);
+    } else if (read_block_raw(replayed[i].blockno, page) != BSIZE) {
+      err_exit("recover_from_log: failed to read block %u",
+               replayed[i].blockno);
+    }
+    for (int j = whole < start ? start : whole + 1; j < next; j++) {
+      memmove(page + replayed[j].off, replayed[j].data, replayed[j].len);
+    }
+    pages[ninstall++] = page;
+  }
+  install_blocks_parallel(blocks, pages, ninstall);
+  // written behind the cache
+  for (int i = 0; i < ninstall; i++) {
+    binvalidate(blocks[i]);
+  }
+  free(merged);
+  free(pages);
+  free(blocks);
+  rc->nreplayed = 0;
+  return ninstall;
+}
+
+// Go through the committed transactions from the tail, batch by batch, up
+// to end (or the first invalid one if scanning): collect the revokes when
+// scanning, install the blocks when replaying.
+// @return the position after the last one, *tid its tid
+static uint64_t recovery_pass(struct recovery* rc, uint64_t tail,
+                              uint64_t* tid, uint64_t end, int replay,
+                              int* ninstall) {
+  uint64_t pos = tail;
+  int partial  = 1;
+  rc->seq      = 0;
+  while (partial && pos < end) {
+    uint64_t n = end - pos;
+    if (n > LOG_RECOVERY_NBLOCKS) {
+      n = LOG_RECOVERY_NBLOCKS;
+    }
+    read_log_blocks(pos, rc->buf, n);
+    rc->buf_pos = pos;
+    rc->nbuf    = n;
+
+    struct fslogheader* lh;
+    while (pos < end &&
+           (lh = recovery_trans(rc, tail, pos, *tid, &partial)) != NULL) {
+      recovery_records(rc, lh, *tid, replay);
+      pos += LOG_NBLOCKS(lh->size) + lh->n;
+      (*tid)++;
+    }
+    if (replay) {
+      *ninstall += recovery_install(rc);
+    }
+    if (pos == rc->buf_pos) {
+      // doesn't fit a whole batch either
+      break;
+    }
+  }
+  return pos;
+}
+
+// Replay the committed transactions from the tail, and empty the log.
+// A first pass finds the last one and the blocks revoked, so a block isn't
+// replayed over a later owner, the second one installs the blocks.
 static void recover_from_log() {
-  read_log_header_from_disk();
-  install_transaction(1);
-  fslog.lh.n = 0;
-  write_log_header_to_disk();
+  static u_char buf[BSIZE];
+  struct fslogsuper* ls = (struct fslogsuper*)buf;
+  if (journal_read_block_raw(fslog.start, buf) != BSIZE) {
+    err_exit("recover_from_log: failed to read the log");
+  }
+  uint64_t tail     = 0;
+  uint64_t tail_tid = 1;
+  if (ls->magic == LOG_MAGIC) {
+    tail     = ls->tail;
+    tail_tid = ls->tail_tid;
+  }
+
+  // after a clean unmount the log is empty, don't read all of it
+  read_log_blocks(tail, buf, 1);
+  uint64_t pos = tail;
+  uint64_t tid = tail_tid;
+  if (log_desc_valid((struct fslogheader*)buf, tid, fslog.nslot)) {
+    struct recovery rc = {0};
+    rc.buf             = malloc((size_t)LOG_RECOVERY_NBLOCKS * BSIZE);
+    if (rc.buf == NULL) {
+      err_exit("recover_from_log: failed to allocate %d blocks",
+               LOG_RECOVERY_NBLOCKS);
+    }
+    int ninstall = 0;
+    pos = recovery_pass(&rc, tail, &tid, tail + fslog.nslot, 0, &ninstall);
+    qsort(rc.revoked, rc.nrevoked, sizeof(rc.revoked[0]), replayed_block_cmp);
+    uint64_t end_tid = tail_tid;
+    recovery_pass(&rc, tail, &end_tid, pos, 1, &ninstall);
+    myfuse_log("recovered %lu transactions, %d blocks installed",
+               tid - tail_tid, ninstall);
+
+    free(rc.replayed);
+    free(rc.revoked);
+    free(rc.buf);
+  }
+  write_log_super(pos, tid);
+
+  fslog.head             = pos;
+  fslog.tail             = pos;
+  fslog.tail_tid         = tid;
+  fslog.running->tid     = tid;
+  fslog.committed_tid    = tid - 1;
+  fslog.checkpointed_tid = tid - 1;
+}
+
+static uint64_t us_since(const struct timespec* t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000000 + (now.tv_nsec - t->tv_nsec) / 1000;
+}
+
+// count a duration of us microseconds in hist
+static void stats_hist_add(uint64_t* hist, uint64_t us) {
+  int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+  hist[bucket < LOG_STATS_NBUCKET ? bucket : LOG_STATS_NBUCKET - 1]++;
+}
+
+// can the running transaction take nblocks more blocks on top of the
+// reserved ones? called with fslog.lock held
+static int log_room_for(int nblocks) {
+  int reserved = fslog.running->blocks.n + fslog.reserved + nblocks;
+  int committing = 0;
+  int ordered    = 0;
+  if (fslog.committing) {
+    committing = fslog.committing->blocks.n;
+    ordered    = fslog.committing->ordered.n;
+  }
+  // every logged block stays pinned until it's checkpointed, an ordered
+  // one until it's written
+  if (log_data_mode == LOG_DATA_ORDERED) {
+    ordered += LOG_ORDERED_NBLOCKS;
+  }
+  if (reserved + committing + ordered + fslog.checkpoint.n > LOG_MAX_NBLOCKS) {
+    return 0;
+  }
+  // the running transaction has to fit in the log with its descriptor
+  return fslog.head - fslog.tail + LOG_TRANS_NBLOCKS(committing) +
+             LOG_TRANS_NBLOCKS(reserved) <=
+         fslog.nslot;
 }
 
 // called at the start of each FS system call
-void begin_op() {
+void begin_op() { begin_op_reserve(MAXOPBLOCKS); }
+
+void begin_op_reserve(int nblocks) {
+  if (nblocks < 0 || nblocks > MAXOPBLOCKS) {
+    err_exit("begin_op_reserve: can't reserve %d blocks", nblocks);
+  }
+  // why and how long the op waited, for the stats
+  int wait_closing = 0;
+  int wait_room    = 0;
+  struct timespec start;
   pthread_mutex_lock(&fslog.lock);
   while (1) {
-    if (fslog.committing) {
+    if (fslog.closing) {
+      if (!wait_closing && !wait_room) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+      }
+      wait_closing = 1;
       pthread_cond_wait(&fslog.wakeup, &fslog.lock);
-    } else if (fslog.lh.n + (fslog.outstanding + 1) * MAXOPBLOCKS > NLOG) {
+    } else if (!log_room_for(nblocks)) {
+      if (!wait_closing && !wait_room) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+      }
+      wait_room = 1;
+      // this op might exhaust log space; ask for a commit or a checkpoint
+      fslog.nwaiting++;
+      pthread_cond_signal(&fslog.journal_wakeup);
       pthread_cond_wait(&fslog.wakeup, &fslog.lock);
+      fslog.nwaiting--;
     } else {
+      struct log_commit_stats* stats = &fslog.running->stats;
+      stats->nops++;
+      if (wait_closing || wait_room) {
+        uint64_t us = us_since(&start);
+        stats->wait_us += us;
+        stats->nwait_closing += wait_closing;
+        stats->nwait_room += wait_room;
+        stats_hist_add(fslog.stats.wait_hist, us);
+      }
       fslog.outstanding++;
+      fslog.reserved += nblocks;
+      op_tid      = fslog.running->tid;
+      op_reserved = nblocks;
       pthread_mutex_unlock(&fslog.lock);
       break;
     }
   }
-  n_log_wrote = 0;
 }
 
-void end_op() {
-  int do_commit = 0;
+int log_extend_op(int nblocks) {
+  pthread_mutex_lock(&fslog.lock);
+  // an op can't wait for room, its transaction couldn't be closed
+  int extended = !fslog.closing && log_room_for(nblocks);
+  if (extended) {
+    fslog.reserved += nblocks;
+    op_reserved += nblocks;
+  }
+  pthread_mutex_unlock(&fslog.lock);
+  return extended;
+}
 
+int log_op_room() { return op_reserved; }
+
+// called at the end of each FS system call.
+// doesn't commit, the journal thread will.
+void end_op() {
+  op_tid = 0;
   pthread_mutex_lock(&fslog.lock);
   fslog.outstanding -= 1;
-  if (fslog.committing) {
-    err_exit("log.committing");
+  fslog.reserved -= op_reserved;
+  op_reserved = 0;
+  // the journal thread may be waiting for the last op to finish,
+  // or be able to start a group commit now
+  pthread_cond_signal(&fslog.journal_wakeup);
+  // begin_op() may be waiting for log space,
+  // and the ending op has given back what it didn't use of its reservation
+  pthread_cond_broadcast(&fslog.wakeup);
+  pthread_mutex_unlock(&fslog.lock);
+}
+
+// wait until transaction tid is on disk, called with fslog.lock held
+static void wait_for_commit(uint64_t tid) {
+  fslog.nforce++;
+  pthread_cond_signal(&fslog.journal_wakeup);
+  while (fslog.committed_tid < tid) {
+    if (fslog.running->tid == tid && transaction_empty(fslog.running)) {
+      // nothing was written in it, only wait for the previous one
+      tid--;
+      continue;
+    }
+    pthread_cond_wait(&fslog.wakeup, &fslog.lock);
   }
-  if (fslog.outstanding == 0) {
-    do_commit        = 1;
-    fslog.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    pthread_cond_broadcast(&fslog.wakeup);
+  fslog.nforce--;
+}
+
+void end_op_sync() {
+  uint64_t tid = op_tid;
+  end_op();
+  pthread_mutex_lock(&fslog.lock);
+  wait_for_commit(tid);
+  pthread_mutex_unlock(&fslog.lock);
+}
+
+void log_sync() {
+  pthread_mutex_lock(&fslog.lock);
+  wait_for_commit(fslog.running->tid);
+  pthread_mutex_unlock(&fslog.lock);
+}
+
+void log_sync_tid(uint64_t tid) {
+  pthread_mutex_lock(&fslog.lock);
+  wait_for_commit(tid);
+  pthread_mutex_unlock(&fslog.lock);
+}
+
+void log_checkpoint() {
+  pthread_mutex_lock(&fslog.lock);
+  wait_for_commit(fslog.running->tid);
+  uint64_t tid = fslog.committed_tid;
+  fslog.nforce_checkpoint++;
+  pthread_cond_signal(&fslog.journal_wakeup);
+  while (fslog.checkpointed_tid < tid) {
+    pthread_cond_wait(&fslog.wakeup, &fslog.lock);
   }
+  fslog.nforce_checkpoint--;
   pthread_mutex_unlock(&fslog.lock);
+}
 
-  if (do_commit) {
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+static uint64_t ms_since(const struct timespec* t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// should the running transaction be closed and committed?
+// called with fslog.lock held
+static int commit_needed() {
+  struct transaction* t = fslog.running;
+  if (transaction_empty(t)) {
+    return 0;
+  }
+  return fslog.nforce > 0 || fslog.nwaiting > 0 ||
+         t->blocks.n + t->ordered.n >= LOG_COMMIT_NBLOCKS ||
+         ms_since(&t->first_write) >= (uint64_t)log_commit_interval_ms;
+}
+
+// should the committed transactions be installed and dropped from the log?
+// called with fslog.lock held, with no committing transaction
+static int checkpoint_needed() {
+  if (fslog.head == fslog.tail) {
+    return fslog.nforce_checkpoint > 0 &&
+           fslog.checkpointed_tid < fslog.committed_tid;
+  }
+  return fslog.nforce_checkpoint > 0 ||
+         fslog.checkpoint.n >= LOG_CHECKPOINT_NBLOCKS ||
+         fslog.head - fslog.tail >= fslog.nslot / 2 ||
+         (fslog.nwaiting > 0 && fslog.running->blocks.n == 0);
+}
+
+// the content of b as of the transaction tid, called with b locked
+static const u_char* logged_data(struct bcache_buf* b, uint64_t tid) {
+  return b->frozen && b->ftid == tid ? b->frozen : b->data;
+}
+
+// Write transaction t to the log at head, straight from the cache, with
+// one vectored write (two if it wraps around the end of the log). The crc in
+// the descriptor tells whether all of it made it to the disk.
+// A block of which t changed a few bytes goes in the descriptor as a delta
+// record, the others are logged whole. A block t revoked isn't logged.
+// The pages stay put until the next checkpoint: a running op modifying one
+// of them moves it to frozen first (see logged_read()).
+// @return the log blocks taken
+static int write_transaction(struct transaction* t, uint64_t head) {
+  static u_char buf[LOG_NBLOCKS(LOG_DESC_MAX_SIZE) * BSIZE];
+  static const u_char* pages[LOG_NBLOCKS(LOG_DESC_MAX_SIZE) + LOG_MAX_NBLOCKS];
+  struct fslogheader* lh = (struct fslogheader*)buf;
+  struct blockset* s     = &t->blocks;
+
+  int nwhole  = 0;
+  int ndelta  = 0;
+  int nrevoke = 0;
+  uint size   = 0;
+  for (int i = 0; i < s->n; i++) {
+    if (transaction_revoked(t, s->block[i])) {
+      continue;
+    } else if (transaction_delta(t, i)) {
+      size += LOG_DELTA_SIZE(t->dirty_end[i] - t->dirty_start[i]);
+      ndelta++;
+    } else {
+      nwhole++;
+    }
+  }
+  for (int i = 0; i < t->revoked.n; i++) {
+    nrevoke += t->revoke_active[i];
+  }
+  size += LOG_DESC_SIZE(nwhole + nrevoke);
+  int ndesc = LOG_NBLOCKS(size);
+  int n     = ndesc + nwhole;
+
+  lh->magic   = LOG_MAGIC;
+  lh->tid     = t->tid;
+  lh->n       = nwhole;
+  lh->nrevoke = nrevoke;
+  lh->ndelta  = ndelta;
+  lh->size    = size;
+  for (int i = 0; i < ndesc; i++) {
+    pages[i] = buf + i * BSIZE;
+  }
+  for (int i = 0, j = nwhole; i < t->revoked.n; i++) {
+    if (t->revoke_active[i]) {
+      lh->block[j++] = t->revoked.block[i];
+    }
+  }
+  u_char* delta = buf + LOG_DESC_SIZE(nwhole + nrevoke);
+  for (int i = 0, j = 0; i < s->n; i++) {
+    if (transaction_revoked(t, s->block[i])) {
+      continue;
+    }
+    struct bcache_buf* b = bread(s->block[i]);
+    const u_char* data   = logged_data(b, t->tid);
+    if (transaction_delta(t, i)) {
+      struct fslogdelta* d = (struct fslogdelta*)delta;
+      d->blockno           = s->block[i];
+      d->off               = t->dirty_start[i];
+      d->len               = t->dirty_end[i] - t->dirty_start[i];
+      memmove(d->data, data + d->off, d->len);
+      memset(d->data + d->len, 0, LOG_DELTA_SIZE(d->len) - sizeof(*d) - d->len);
+      delta += LOG_DELTA_SIZE(d->len);
+    } else {
+      pages[ndesc + j] = data;
+      lh->block[j]     = s->block[i];
+      j++;
+    }
+    brelse(b);
+  }
+  uint crc = log_desc_crc(lh);
+  for (int i = ndesc; i < n; i++) {
+    crc = crc32c(crc, pages[i], BSIZE);
+  }
+  lh->crc = crc;
+  t->stats.ndelta  = ndelta;
+  t->stats.nrevoke = nrevoke;
+  t->stats.nlog    = n;
+  t->stats.ndesc   = ndesc;
+
+  uint first = fslog.nslot - head % fslog.nslot;
+  if (first > (uint)n) {
+    first = n;
+  }
+  if (journal_write_blocks_vec_raw(log_blockno(head), pages, first) !=
+          (int)first * BSIZE ||
+      journal_write_blocks_vec_raw(log_blockno(head + first), pages + first,
+                                   n - first) != (n - (int)first) * BSIZE) {
+    err_exit("write_transaction: failed to write the log");
+  }
+  return n;
+}
+
+static int log_block_logged(uint blockno);
+
+// Write the ordered data blocks of t in place, sorted.
+// A block logged meanwhile is left to the log.
+static void write_ordered(struct transaction* t) {
+  static uint blocks[LOG_MAX_NBLOCKS];
+  blockset_sorted(&t->ordered, blocks);
+  for (int i = 0; i < t->ordered.n; i++) {
+    struct bcache_buf* b = bread(blocks[i]);
     pthread_mutex_lock(&fslog.lock);
-    fslog.committing = 0;
-    pthread_cond_broadcast(&fslog.wakeup);
+    int logged = log_block_logged(b->blockno);
     pthread_mutex_unlock(&fslog.lock);
+    if (!logged && write_block_raw(b->blockno, b->data) != BSIZE) {
+      err_exit("write_ordered: failed to write block %u", b->blockno);
+    }
+    bunpin(b);
+    brelse(b);
+  }
+}
+
+// @return the log blocks taken by t
+static int commit(struct transaction* t) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  write_ordered(t);
+  // the data written in place, ordered or not, reach the disk before the
+  // log blocks that refer to them
+  if (block_device_flush() != 0) {
+    err_exit("commit: failed to flush the disk");
+  }
+  t->stats.nordered   = t->ordered.n;
+  t->stats.ordered_us = us_since(&start);
+  t->stats.nblocks    = t->blocks.n;
+  if (t->blocks.n == 0 && t->revoked.n == 0) {
+    return 0;
+  }
+  // only the journal thread moves head
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int nlogged = write_transaction(t, fslog.head);
+  // t is committed once its descriptor is on stable storage, before
+  // log_sync_tid() waiters are woken
+  if (block_device_flush_journal() != 0) {
+    err_exit("commit: failed to flush the log");
+  }
+  t->stats.write_us = us_since(&start);
+
+  // t's blocks are to be checkpointed now, keep one pin per block
+  for (int i = 0; i < t->blocks.n; i++) {
+    struct bcache_buf* b = bread(t->blocks.block[i]);
+    pthread_mutex_lock(&fslog.lock);
+    int index;
+    if (blockset_add_index(&fslog.checkpoint, b->blockno, &index)) {
+      fslog.checkpoint_ltid[index] = 0;
+      fslog.checkpoint_rtid[index] = 0;
+    } else {
+      bunpin(b);
+    }
+    if (!transaction_revoked(t, b->blockno)) {
+      fslog.checkpoint_ltid[index] = t->tid;
+    }
+    pthread_mutex_unlock(&fslog.lock);
+    brelse(b);
+  }
+  // a block revoked was logged by t or an earlier transaction, it's to be
+  // checkpointed
+  pthread_mutex_lock(&fslog.lock);
+  for (int i = 0; i < t->revoked.n; i++) {
+    int slot = *blockset_lookup(&fslog.checkpoint, t->revoked.block[i]);
+    if (t->revoke_active[i] && slot != 0) {
+      fslog.checkpoint_rtid[slot - 1] = t->tid;
+    }
   }
+  pthread_mutex_unlock(&fslog.lock);
+  return nlogged;
 }
 
-static void write_from_cache_to_log() {
-  for (int tail = 0; tail < fslog.lh.n; tail++) {
-    struct bcache_buf* to   = bread(fslog.start + tail + 1);
-    struct bcache_buf* from = bread(fslog.lh.block[tail]);
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);
-    brelse(to);
-    brelse(from);
+// the page a buf had in the cache, restored once no copy is needed
+static void unfreeze(struct bcache_buf* b) {
+  if (b->frozen == 0) {
+    return;
   }
+  u_char* page = bcache_page(b);
+  if (b->data != page) {
+    memmove(page, b->data, BSIZE);
+    free(b->data);
+    b->data = page;
+  } else {
+    free(b->frozen);
+  }
+  b->frozen = 0;
 }
 
-static void commit() {
-  if (fslog.lh.n > 0) {
-    write_from_cache_to_log();
-    write_log_header_to_disk();
-    install_transaction(0);
-    fslog.lh.n = 0;
-    write_log_header_to_disk();
+// Install every committed block at its home location, and drop the
+// committed transactions from the log.
+// A block committed by several transactions since the last checkpoint is
+// installed once, a block revoked since is not (it may hold file data
+// written in place). Blocks are sorted, contiguous ones written together.
+// Called by the journal thread when there's no committing transaction, so
+// every closed transaction is committed: the content to install is the
+// frozen one only if the running transaction logged the block.
+// @return the number of blocks installed
+static int checkpoint() {
+  static uint blocks[LOG_MAX_NBLOCKS];
+  static const u_char* pages[LOG_MAX_NBLOCKS];
+  static struct bcache_buf* bufs[LOG_MAX_NBLOCKS];
+  // only the journal thread changes the set
+  int n = fslog.checkpoint.n;
+
+  pthread_mutex_lock(&fslog.lock);
+  uint64_t head     = fslog.head;
+  uint64_t head_tid = fslog.committed_tid + 1;
+  pthread_mutex_unlock(&fslog.lock);
+
+  blockset_sorted(&fslog.checkpoint, blocks);
+  int ninstall = 0;
+  for (int i = 0; i < n; i++) {
+    struct bcache_buf* b = bread(blocks[i]);
+    bufs[i]              = b;
+    if (!checkpoint_dead(blocks[i])) {
+      blocks[ninstall] = blocks[i];
+      pages[ninstall]  = b->jtid >= head_tid ? b->frozen : b->data;
+      ninstall++;
+    }
+    brelse(b);
+  }
+  struct install_range all = {blocks, pages, ninstall};
+  install_blocks(&all);
+
+  // the log is empty, on disk too
+  write_log_super(head, head_tid);
+  for (int i = 0; i < n; i++) {
+    struct bcache_buf* b = bufs[i];
+    pthread_mutex_lock(&b->lock);
+    if (b->jtid < head_tid) {
+      b->jtid = 0;
+      unfreeze(b);
+    }
+    pthread_mutex_unlock(&b->lock);
+    bunpin(b);
+  }
+
+  pthread_mutex_lock(&fslog.lock);
+  blockset_clear(&fslog.checkpoint);
+  fslog.tail             = head;
+  fslog.tail_tid         = head_tid;
+  fslog.checkpointed_tid = head_tid - 1;
+  pthread_cond_broadcast(&fslog.wakeup);
+  pthread_mutex_unlock(&fslog.lock);
+  return ninstall;
+}
+
+// record the stats of t, just committed. called with fslog.lock held
+static void record_commit(struct transaction* t) {
+  t->stats.tid              = t->tid;
+  t->stats.ninstall         = fslog.checkpoint_ninstall;
+  t->stats.install_us       = fslog.checkpoint_us;
+  fslog.checkpoint_ninstall = 0;
+  fslog.checkpoint_us       = 0;
+
+  fslog.stats_ring[fslog.stats.ncommit % LOG_STATS_NRECORD] = t->stats;
+  fslog.stats.ncommit++;
+  stats_hist_add(fslog.stats.commit_hist, t->stats.commit_us);
+}
+
+// Group commit.
+// Ops ending within log_commit_interval_ms of the first write of the running
+// transaction are committed together, earlier if the transaction grows to
+// LOG_COMMIT_NBLOCKS blocks, log space runs short or someone waits for it.
+//
+// Closing the running transaction only waits for its ops to finish, the
+// next one starts taking ops before the closed one is written.
+//
+// Committed blocks are installed lazily, by a checkpoint once the log is
+// half full, LOG_CHECKPOINT_NBLOCKS blocks wait for it, or begin_op() needs
+// the room.
+static void* journal_thread(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&fslog.lock);
+  while (1) {
+    while (!commit_needed() && !checkpoint_needed()) {
+      if (transaction_empty(fslog.running)) {
+        pthread_cond_wait(&fslog.journal_wakeup, &fslog.lock);
+      } else {
+        struct timespec deadline = fslog.running->first_write;
+        deadline.tv_sec += log_commit_interval_ms / 1000;
+        deadline.tv_nsec += log_commit_interval_ms % 1000 * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&fslog.journal_wakeup, &fslog.lock,
+                               &deadline);
+      }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (checkpoint_needed()) {
+      pthread_mutex_unlock(&fslog.lock);
+      int ninstall = checkpoint();
+      pthread_mutex_lock(&fslog.lock);
+      uint64_t us = us_since(&start);
+      fslog.checkpoint_ninstall += ninstall;
+      fslog.checkpoint_us += us;
+      fslog.stats.ncheckpoint++;
+      stats_hist_add(fslog.stats.install_hist, us);
+      continue;
+    }
+
+    // close the running transaction, and wait for its ops to finish
+    fslog.closing = 1;
+    while (fslog.outstanding > 0) {
+      pthread_cond_wait(&fslog.journal_wakeup, &fslog.lock);
+    }
+    struct transaction* t = fslog.running;
+    t->stats.close_us     = us_since(&start);
+    fslog.committing      = t;
+    fslog.running         = t == &fslog.trans[0] ? &fslog.trans[1]
+                                                 : &fslog.trans[0];
+    fslog.running->tid    = t->tid + 1;
+    memset(&fslog.running->stats, 0, sizeof(fslog.running->stats));
+    fslog.closing = 0;
+    pthread_cond_broadcast(&fslog.wakeup);
+    pthread_mutex_unlock(&fslog.lock);
+
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    int nlogged = commit(t);
+
+    pthread_mutex_lock(&fslog.lock);
+    fslog.head += nlogged;
+    fslog.committed_tid = t->tid;
+    fslog.committing    = 0;
+    t->stats.commit_us  = us_since(&start);
+    record_commit(t);
+    blockset_clear(&t->blocks);
+    blockset_clear(&t->revoked);
+    blockset_clear(&t->ordered);
+    pthread_cond_broadcast(&fslog.wakeup);
   }
+  return NULL;
 }
 
-// use this dark magic to make higher level need not to worry about the limit of
-// MAXOPBLOCK
-uint __thread n_log_wrote = 0;
+void logged_write(struct bcache_buf* b) { logged_write_range(b, 0, BSIZE); }
 
-void logged_write(struct bcache_buf* b) {
+void logged_write_range(struct bcache_buf* b, uint off, uint n) {
+  if (off + n > BSIZE || n == 0) {
+    err_exit("logged_write_range: bad range %u+%u", off, n);
+  }
   pthread_mutex_lock(&fslog.lock);
-  if (fslog.lh.n >= NLOG || fslog.lh.n >= fslog.size - 1) {
+  struct transaction* t = fslog.running;
+  struct blockset* s    = &t->blocks;
+  if (s->n >= LOG_MAX_NBLOCKS ||
+      LOG_TRANS_NBLOCKS(s->n + 1) > (int)fslog.nslot) {
     err_exit("too big a transaction");
   }
   if (fslog.outstanding < 1) {
     err_exit("logged_write outside of transaction");
   }
 
-  n_log_wrote++;
+  if (transaction_empty(t)) {
+    clock_gettime(CLOCK_MONOTONIC, &t->first_write);
+  }
+  b->jtid = t->tid;
+
+  int i;
+  if (blockset_add_index(s, b->blockno, &i)) {
+    t->dirty_start[i] = off;
+    t->dirty_end[i]   = off + n;
+    bpin(b);
+    // a block new to the transaction takes one of the op's reserved,
+    // or room no other op reserved
+    if (op_reserved > 0) {
+      op_reserved--;
+      fslog.reserved--;
+    } else if (!log_room_for(0)) {
+      err_exit("logged_write: the op logged more blocks than it reserved");
+    }
+  } else {
+    // write to the same block in the log, which has changed a bit more
+    t->stats.nabsorbed++;
+    if (off < t->dirty_start[i]) {
+      t->dirty_start[i] = off;
+    }
+    if (off + n > t->dirty_end[i]) {
+      t->dirty_end[i] = off + n;
+    }
+  }
+  // a block revoked (and so reused) is logged whole: it's replayed on top of
+  // whatever is at its home location
+  int revoked = *blockset_lookup(&t->revoked, b->blockno);
+  if (revoked != 0 || checkpoint_dead(b->blockno)) {
+    t->dirty_start[i] = 0;
+    t->dirty_end[i]   = BSIZE;
+  }
+  if (revoked != 0) {
+    // the records of the older transactions are replayed before this one
+    t->revoke_active[revoked - 1] = 0;
+  }
+  pthread_mutex_unlock(&fslog.lock);
+}
+
+// is blockno owed to the log? called with fslog.lock held.
+// A block stops being owed once a committed transaction revoked it
+static int log_block_logged(uint blockno) {
+  return blockset_contains(&fslog.running->blocks, blockno) ||
+         (fslog.committing &&
+          blockset_contains(&fslog.committing->blocks, blockno)) ||
+         (blockset_contains(&fslog.checkpoint, blockno) &&
+          !checkpoint_dead(blockno));
+}
+
+void log_revoke(uint blockno) {
+  pthread_mutex_lock(&fslog.lock);
+  if (fslog.outstanding < 1) {
+    err_exit("log_revoke outside of transaction");
+  }
+  if (log_block_logged(blockno)) {
+    struct transaction* t = fslog.running;
+    // a block revoked is held by the log, as many as it can hold
+    if (t->revoked.n >= LOG_MAX_NBLOCKS) {
+      err_exit("log_revoke: too many blocks revoked");
+    }
+    if (transaction_empty(t)) {
+      clock_gettime(CLOCK_MONOTONIC, &t->first_write);
+    }
+    int i;
+    blockset_add_index(&t->revoked, blockno, &i);
+    t->revoke_active[i] = 1;
+  }
+  pthread_mutex_unlock(&fslog.lock);
+}
+
+void logged_write_data(struct bcache_buf* b) {
+  if (log_data_mode == LOG_DATA_JOURNAL) {
+    logged_write(b);
+    return;
+  }
+
+  pthread_mutex_lock(&fslog.lock);
+  if (fslog.outstanding < 1) {
+    err_exit("logged_write_data outside of transaction");
+  }
+  if (log_block_logged(b->blockno)) {
+    pthread_mutex_unlock(&fslog.lock);
+    logged_write(b);
+    return;
+  }
 
-  int block_idx;
-  for (block_idx = 0; block_idx < fslog.lh.n; block_idx++) {
-    if (fslog.lh.block[block_idx] == b->blockno) {
-      break;  // write to the same block in the log
+  struct transaction* t = fslog.running;
+  if (t->ordered.n >= LOG_ORDERED_NBLOCKS &&
+      !blockset_contains(&t->ordered, b->blockno)) {
+    // the transaction keeps enough pinned, write this one now
+    pthread_mutex_unlock(&fslog.lock);
+    if (write_block_raw(b->blockno, b->data) != BSIZE) {
+      err_exit("logged_write_data: failed to write block %u", b->blockno);
     }
+    return;
+  }
+  if (transaction_empty(t)) {
+    clock_gettime(CLOCK_MONOTONIC, &t->first_write);
   }
-  fslog.lh.block[block_idx] = b->blockno;
-  if (block_idx == fslog.lh.n) {
+  if (blockset_add(&t->ordered, b->blockno)) {
     bpin(b);
-    fslog.lh.n++;
   }
   pthread_mutex_unlock(&fslog.lock);
 }
 
+int log_block_pending(uint blockno) {
+  pthread_mutex_lock(&fslog.lock);
+  int pending =
+      log_block_logged(blockno) ||
+      blockset_contains(&fslog.running->ordered, blockno) ||
+      (fslog.committing &&
+       blockset_contains(&fslog.committing->ordered, blockno));
+  pthread_mutex_unlock(&fslog.lock);
+  return pending;
+}
+
+uint64_t log_op_tid() { return op_tid; }
+
+uint64_t log_running_tid() {
+  pthread_mutex_lock(&fslog.lock);
+  uint64_t tid = fslog.running->tid;
+  pthread_mutex_unlock(&fslog.lock);
+  return tid;
+}
+
+uint64_t log_committed_tid() {
+  pthread_mutex_lock(&fslog.lock);
+  uint64_t tid = fslog.committed_tid;
+  pthread_mutex_unlock(&fslog.lock);
+  return tid;
+}
+
+// Copy-on-write for the closed transactions.
+// A block logged by an earlier transaction may not be in the log or
+// installed yet, the journal thread writes it from the cache. Freeze its page
+// before the caller modifies it: the page becomes b->frozen, and b->data a
+// copy of it. The journal thread may be writing from the page without
+// holding b->lock, so it must not move.
+// One frozen copy is enough: a checkpoint only runs once every closed
+// transaction is committed, so an older frozen copy is only needed until
+// the next closed transaction logging the block.
+// An op of the running transaction can only see jtid of the earlier ones,
+// which was set before the op began.
 struct bcache_buf* logged_read(uint blockno) {
-  return bread(blockno);
+  struct bcache_buf* b = bread(blockno);
+  if (b->jtid == 0 || b->jtid >= op_tid ||
+      (b->frozen && b->ftid == b->jtid)) {
+    return b;
+  }
+  u_char* copy = b->frozen;
+  if (copy == 0) {
+    copy = malloc(BSIZE);
+    if (copy == NULL) {
+      err_exit("logged_read: failed to freeze a committing block");
+    }
+  }
+  memmove(copy, b->data, BSIZE);
+  b->frozen = b->data;
+  b->ftid   = b->jtid;
+  b->data   = copy;
+  return b;
 }
 
 void logged_relse(struct bcache_buf* b) { brelse(b); }
+
+int log_stats_read(struct log_commit_stats* records, int n,
+                   struct log_stats* stats) {
+  pthread_mutex_lock(&fslog.lock);
+  uint64_t ncommit = fslog.stats.ncommit;
+  if ((uint64_t)n > ncommit) {
+    n = ncommit;
+  }
+  if (n > LOG_STATS_NRECORD) {
+    n = LOG_STATS_NRECORD;
+  }
+  for (int i = 0; i < n; i++) {
+    records[i] = fslog.stats_ring[(ncommit - n + i) % LOG_STATS_NRECORD];
+  }
+  *stats = fslog.stats;
+  pthread_mutex_unlock(&fslog.lock);
+  return n;
+}
+
+static void dump_hist(FILE* f, const char* name, const uint64_t* hist) {
+  fprintf(f, "%s (us)\n", name);
+  for (int i = 0; i < LOG_STATS_NBUCKET; i++) {
+    if (hist[i] != 0) {
+      fprintf(f, "  <= %-12llu %llu\n", 1ull << i,
+              (unsigned long long)hist[i]);
+    }
+  }
+}
+
+void log_stats_dump(FILE* f) {
+  static struct log_commit_stats records[LOG_STATS_NRECORD];
+  static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+  struct log_stats stats;
+  pthread_mutex_lock(&dump_lock);
+  int n = log_stats_read(records, LOG_STATS_NRECORD, &stats);
+
+  fprintf(f, "commits %llu checkpoints %llu\n",
+          (unsigned long long)stats.ncommit,
+          (unsigned long long)stats.ncheckpoint);
+  fprintf(f,
+          "tid ops blocks absorbed delta revoke ordered log desc "
+          "wait_closing wait_room wait_us close_us ordered_us write_us "
+          "commit_us install install_us\n");
+  for (int i = 0; i < n; i++) {
+    struct log_commit_stats* r = &records[i];
+    fprintf(f, "%llu %u %u %u %u %u %u %u %u %u %u %llu %llu %llu %llu %llu "
+            "%u %llu\n",
+            (unsigned long long)r->tid, r->nops, r->nblocks, r->nabsorbed,
+            r->ndelta, r->nrevoke, r->nordered, r->nlog, r->ndesc,
+            r->nwait_closing, r->nwait_room, (unsigned long long)r->wait_us,
+            (unsigned long long)r->close_us, (unsigned long long)r->ordered_us,
+            (unsigned long long)r->write_us, (unsigned long long)r->commit_us,
+            r->ninstall, (unsigned long long)r->install_us);
+  }
+  dump_hist(f, "begin_op wait", stats.wait_hist);
+  dump_hist(f, "commit", stats.commit_hist);
+  dump_hist(f, "checkpoint", stats.install_hist);
+  pthread_mutex_unlock(&dump_lock);
+}
@@ -17,6 +17,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <pthread.h>
 
 #include "param.h"
 #include "file.h"
@@ -25,16 +26,29 @@
 #include "log.h"
 #include "buf_cache.h"
 #include "block_device.h"
+#include "warmup.h"
+#include "mem_pressure.h"
 
 struct options options;
 
 void* myfuse_init(struct fuse_conn_info* conn, struct fuse_config* config);
+void myfuse_destroy(void* private_data);
 
 #define OPTION(t, p) \
   { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
-    OPTION("--device_path=%s", device_path), OPTION("-h", show_help),
-    OPTION("--help", show_help), FUSE_OPT_END};
+    OPTION("--device_path=%s", device_path),
+    OPTION("--warmup_path=%s", warmup_path),
+    OPTION("--warmup_interval=%d", warmup_interval),
+    OPTION("--bypass_threshold=%lu", bypass_threshold),
+    OPTION("--rss_target=%lu", rss_target),
+    OPTION("--data=%s", data_mode),
+    OPTION("--commit_interval_ms=%d", commit_interval_ms),
+    OPTION("--journal_stats=%s", journal_stats_path),
+    OPTION("--journal_path=%s", journal_path),
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    FUSE_OPT_END};
 
 static void show_help(const char* progname) {
   printf("usage: %s [options] <mountpoint>\n\n", progname);
@@ -42,11 +56,39 @@ static void show_help(const char* progname) {
       "File-system specific options:\n"
       "    --device_path=<s>          Path to the disk device\n"
       "                               example: /dev/sdb\n"
+      "    --warmup_path=<s>          File to save the hot cached blocks in at\n"
+      "                               unmount, they are prefetched on the next\n"
+      "                               mount (default: disabled)\n"
+      "    --warmup_interval=<d>      Also save the hot blocks every <d> seconds\n"
+      "                               (default: 0, save at unmount only)\n"
+      "    --bypass_threshold=<n>     Reads and writes of at least <n> bytes of\n"
+      "                               full blocks bypass the block cache\n"
+      "                               (default: 65536, 0 to disable)\n"
+      "    --rss_target=<n>           Shrink the caches while the resident\n"
+      "                               memory is above <n> MiB, they are also\n"
+      "                               shrunk on memory pressure (PSI)\n"
+      "                               (default: 0, no target)\n"
+      "    --data=<s>                 How file contents are written: ordered\n"
+      "                               (in place, before the metadata commits)\n"
+      "                               or journal (through the log)\n"
+      "                               (default: ordered)\n"
+      "    --commit_interval_ms=<d>   Commit the changes to the log every <d>\n"
+      "                               milliseconds, earlier if the log fills\n"
+      "                               or on fsync; a crash loses at most that\n"
+      "                               much (default: 5)\n"
+      "    --journal_stats=<s>        Dump the journal statistics (the last\n"
+      "                               commits and histograms) to <s> on\n"
+      "                               SIGUSR1 and at unmount\n"
+      "                               (default: disabled)\n"
+      "    --journal_path=<s>         Path to the external journal, when it\n"
+      "                               moved since mkfs -J (default: the one\n"
+      "                               recorded by mkfs)\n"
       "\n");
 }
 
 static const struct fuse_operations myfuse_oper = {
     .init       = myfuse_init,
+    .destroy    = myfuse_destroy,
     .getattr    = myfuse_getattr,
     .access     = myfuse_access,
     .create     = myfuse_create,
@@ -59,6 +101,8 @@ static const struct fuse_operations myfuse_oper = {
     .open       = myfuse_open,
     .read       = myfuse_read,
     .write      = myfuse_write,
+    .fsync      = myfuse_fsync,
+    .fsyncdir   = myfuse_fsyncdir,
     .release    = myfuse_release,
     .releasedir = myfuse_releasedir,
     .chmod      = myfuse_chmod,
@@ -80,16 +124,52 @@ void SIGSEVG_handler(int sig) {
   exit(1);
 }
 
+static void journal_stats_dump() {
+  FILE* f = fopen(options.journal_stats_path, "w");
+  if (f == NULL) {
+    myfuse_nonfatal("failed to open %s", options.journal_stats_path);
+    return;
+  }
+  log_stats_dump(f);
+  fclose(f);
+}
+
+// dump the journal stats on each SIGUSR1, blocked in every other thread
+static void* journal_stats_thread(void* arg) {
+  (void)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  while (1) {
+    int sig;
+    if (sigwait(&set, &sig) == 0) {
+      journal_stats_dump();
+    }
+  }
+  return NULL;
+}
+
 int main(int argc, char* argv[]) {
   int ret;
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
   signal(SIGSEGV, SIGSEVG_handler);
 
+  options.bypass_threshold   = BYPASS_CACHE_THRESHOLD;
+  options.commit_interval_ms = LOG_COMMIT_INTERVAL_MS;
+
   if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
     return 1;
   }
 
+  if (options.journal_stats_path != NULL) {
+    // the threads fuse starts inherit the mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+  }
+
   if (options.show_help) {
     show_help(argv[0]);
     assert(fuse_opt_add_arg(&args, "--help") == 0);
@@ -119,15 +199,63 @@ void* myfuse_init(struct fuse_conn_info* conn, struct fuse_config* config) {
     err_exit("disk magic not match! read %x", state->sb.magic);
   }
 
+  if (state->sb.journal != 0) {
+    block_device_init_journal(options.journal_path != NULL
+                                  ? options.journal_path
+                                  : state->sb.journal_path);
+  } else if (options.journal_path != NULL) {
+    err_exit("the disk has its log inside, no external journal");
+  }
+
   // block cache init
   bcache_init();
+  bypass_cache_threshold = options.bypass_threshold;
 
+  if (options.data_mode == NULL || strcmp(options.data_mode, "ordered") == 0) {
+    log_data_mode = LOG_DATA_ORDERED;
+  } else if (strcmp(options.data_mode, "journal") == 0) {
+    log_data_mode = LOG_DATA_JOURNAL;
+  } else {
+    err_exit("unknown data mode %s", options.data_mode);
+  }
+  if (options.commit_interval_ms < 0) {
+    err_exit("bad commit interval %d ms", options.commit_interval_ms);
+  }
+  log_commit_interval_ms = options.commit_interval_ms;
   log_init(&state->sb);
 
   inode_init(&state->sb);
 
   file_init();
 
+  mem_pressure_start(options.rss_target * 1024);
+
+  if (options.warmup_path != NULL) {
+    // prefetch in the background, the mount is available right now
+    warmup_start(options.warmup_path, &state->sb,
+                 options.warmup_interval < 0 ? 0 : options.warmup_interval);
+  }
+
+  if (options.journal_stats_path != NULL) {
+    pthread_t stats;
+    if (pthread_create(&stats, NULL, journal_stats_thread, NULL) != 0) {
+      err_exit("failed to create the journal stats thread");
+    }
+    pthread_detach(stats);
+  }
+
   myfuse_debug_log("fs init done; size %d", state->sb.size);
   return state;
+}
+
+void myfuse_destroy(void* private_data) {
+  (void)private_data;
+  mem_pressure_stop();
+  log_checkpoint();
+  if (options.journal_stats_path != NULL) {
+    journal_stats_dump();
+  }
+  if (options.warmup_path != NULL) {
+    warmup_stop();
+  }
 }
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "mem_pressure.h"
+#include "buf_cache.h"
+#include "inode.h"
+#include "file.h"
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+
+static struct {
+  pthread_t watcher;
+  int running;
+  int stop_pipe[2];  // written by mem_pressure_stop() to wake the watcher
+  int psi_fd;        // -1 if no PSI trigger
+  unsigned long rss_target_kb;
+} mem;
+
+void mem_pressure_shrink(uint keep_nbuf) {
+  uint nbuf   = bcache_shrink(keep_nbuf);
+  uint ninode = itable_shrink();
+  uint nfile  = ftable_shrink();
+  malloc_trim(0);
+  myfuse_debug_log("mem_pressure: released %u bufs, %u inodes, %u files",
+                   nbuf, ninode, nfile);
+}
+
+static unsigned long rss_kb() {
+  unsigned long size, resident;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// open a PSI trigger on the memory.pressure of our cgroup (v2), falling back
+// to the system wide one
+// @return the fd to poll, -1 if PSI is not available
+static int psi_open() {
+  char path[4096] = "/proc/pressure/memory";
+  char line[4096];
+  FILE* f = fopen("/proc/self/cgroup", "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      // the cgroup v2 entry is `0::/path'
+      if (strncmp(line, "0::", 3) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        char cgroup_path[4096];
+        snprintf(cgroup_path, sizeof(cgroup_path),
+                 "/sys/fs/cgroup%s/memory.pressure", line + 3);
+        if (access(cgroup_path, W_OK) == 0) {
+          strcpy(path, cgroup_path);
+        }
+        break;
+      }
+    }
+    fclose(f);
+  }
+
+  int fd = open(path, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+  if (write(fd, MEM_PSI_TRIGGER, strlen(MEM_PSI_TRIGGER) + 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  myfuse_debug_log("mem_pressure: watching %s", path);
+  return fd;
+}
+
+static void* watcher(void* arg) {
+  (void)arg;
+  struct pollfd fds[2];
+  int nfds = 1;
+  fds[0]   = (struct pollfd){.fd = mem.stop_pipe[0], .events = POLLIN};
+  if (mem.psi_fd >= 0) {
+    fds[1] = (struct pollfd){.fd = mem.psi_fd, .events = POLLPRI};
+    nfds   = 2;
+  }
+
+  while (1) {
+    int timeout = mem.rss_target_kb != 0 ? MEM_CHECK_INTERVAL_MS : -1;
+    int n       = poll(fds, nfds, timeout);
+    if (n < 0) {
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      break;
+    }
+    if (nfds == 2 && (fds[1].revents & POLLERR)) {
+      // the cgroup is gone, keep the RSS target only
+      myfuse_nonfatal("mem_pressure: PSI trigger is broken");
+      nfds = 1;
+    } else if (nfds == 2 && (fds[1].revents & POLLPRI)) {
+      // stalls on memory, give half of the cache back
+      mem_pressure_shrink(bcache_nresident() / 2);
+    }
+    if (mem.rss_target_kb != 0 && rss_kb() > mem.rss_target_kb) {
+      mem_pressure_shrink(bcache_nresident() / 2);
+    }
+  }
+  return NULL;
+}
+
+void mem_pressure_start(unsigned long rss_target_kb) {
+  mem.rss_target_kb = rss_target_kb;
+  mem.psi_fd        = psi_open();
+  if (mem.psi_fd < 0 && rss_target_kb == 0) {
+    myfuse_debug_log("mem_pressure: no PSI and no RSS target, not watching");
+    return;
+  }
+  if (pipe(mem.stop_pipe) != 0) {
+    myfuse_nonfatal("mem_pressure: failed to create pipe");
+    return;
+  }
+  if (pthread_create(&mem.watcher, NULL, watcher, NULL) != 0) {
+    myfuse_nonfatal("mem_pressure: failed to create watcher thread");
+    return;
+  }
+  mem.running = 1;
+}
+
+void mem_pressure_stop() {
+  if (!mem.running) {
+    return;
+  }
+  char c = 0;
+  if (write(mem.stop_pipe[1], &c, 1) == 1) {
+    pthread_join(mem.watcher, NULL);
+  }
+  close(mem.stop_pipe[0]);
+  close(mem.stop_pipe[1]);
+  if (mem.psi_fd >= 0) {
+    close(mem.psi_fd);
+  }
+  mem.running = 0;
+}
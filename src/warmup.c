@@ -0,0 +1,186 @@
+#include "warmup.h"
+#include "buf_cache.h"
+#include "util.h"
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  int stop;  // set by warmup_stop(), tell every thread to exit
+  const char* path;
+  struct superblock* sb;
+  uint interval;  // seconds between two saves, 0 to save at unmount only
+
+  uint* blocknos;
+  uint n;
+  pthread_t prefetcher[NWARMUP_THREAD];
+  int nprefetcher;
+  pthread_t saver;
+  int has_saver;
+} warmup;
+
+static int blockno_cmp(const void* a, const void* b) {
+  uint x = *(const uint*)a;
+  uint y = *(const uint*)b;
+  return x < y ? -1 : x > y;
+}
+
+int warmup_save(const char* path, struct superblock* sb) {
+  uint* blocknos = malloc(sizeof(uint) * NCACHE_BUF);
+  if (blocknos == NULL) {
+    return -1;
+  }
+  struct warmup_header header = {
+      .magic   = WARMUP_MAGIC,
+      .fsmagic = sb->magic,
+      .fssize  = sb->size,
+      .n       = bcache_hot_blocks(blocknos, NCACHE_BUF),
+  };
+
+  // write to a temporary file and rename it, so a crash in the middle
+  // won't leave a torn file behind
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE* f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    free(blocknos);
+    return -1;
+  }
+  int res = 0;
+  if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+      fwrite(blocknos, sizeof(uint), header.n, f) != header.n) {
+    res = -1;
+  }
+  if (fclose(f) != 0) {
+    res = -1;
+  }
+  free(blocknos);
+  if (res == 0 && rename(tmp_path, path) != 0) {
+    res = -1;
+  }
+  if (res != 0) {
+    myfuse_nonfatal("warmup: failed to save hot blocks to %s", path);
+    remove(tmp_path);
+  }
+  return res;
+}
+
+// @return the number of block numbers loaded into warmup.blocknos
+static uint warmup_load(const char* path, struct superblock* sb) {
+  struct warmup_header header;
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != WARMUP_MAGIC || header.fsmagic != sb->magic ||
+      header.fssize != sb->size || header.n > NCACHE_BUF) {
+    myfuse_nonfatal("warmup: %s is not a valid warm-up file", path);
+    fclose(f);
+    return 0;
+  }
+  warmup.blocknos = malloc(sizeof(uint) * header.n);
+  if (warmup.blocknos == NULL && header.n > 0) {
+    myfuse_nonfatal("warmup: no memory for %u hot blocks", header.n);
+    fclose(f);
+    return 0;
+  }
+  uint n = fread(warmup.blocknos, sizeof(uint), header.n, f);
+  fclose(f);
+
+  // drop the block numbers out side of the disk
+  uint valid_n = 0;
+  for (uint i = 0; i < n; i++) {
+    if (warmup.blocknos[i] < sb->size) {
+      warmup.blocknos[valid_n++] = warmup.blocknos[i];
+    }
+  }
+  // read in disk order, each thread walks a contiguous range
+  qsort(warmup.blocknos, valid_n, sizeof(uint), blockno_cmp);
+  return valid_n;
+}
+
+static void* prefetch_worker(void* arg) {
+  uint id    = (uint)(size_t)arg;
+  uint start = warmup.n * id / NWARMUP_THREAD;
+  uint end   = warmup.n * (id + 1) / NWARMUP_THREAD;
+  for (uint i = start; i < end; i++) {
+    if (__atomic_load_n(&warmup.stop, __ATOMIC_RELAXED)) {
+      break;
+    }
+    bprefetch(warmup.blocknos[i]);
+  }
+  return NULL;
+}
+
+static void* save_worker(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&warmup.lock);
+  while (!warmup.stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += warmup.interval;
+    int res = 0;
+    while (!warmup.stop && res != ETIMEDOUT) {
+      res = pthread_cond_timedwait(&warmup.wakeup, &warmup.lock, &deadline);
+    }
+    if (!warmup.stop) {
+      pthread_mutex_unlock(&warmup.lock);
+      warmup_save(warmup.path, warmup.sb);
+      pthread_mutex_lock(&warmup.lock);
+    }
+  }
+  pthread_mutex_unlock(&warmup.lock);
+  return NULL;
+}
+
+void warmup_start(const char* path, struct superblock* sb, uint interval) {
+  pthread_mutex_init(&warmup.lock, NULL);
+  pthread_cond_init(&warmup.wakeup, NULL);
+  warmup.stop     = 0;
+  warmup.path     = path;
+  warmup.sb       = sb;
+  warmup.interval = interval;
+
+  warmup.n = warmup_load(path, sb);
+  myfuse_debug_log("warmup: prefetching %u blocks", warmup.n);
+  warmup.nprefetcher = 0;
+  for (int i = 0; i < NWARMUP_THREAD && warmup.n > 0; i++) {
+    if (pthread_create(&warmup.prefetcher[i], NULL, prefetch_worker,
+                       (void*)(size_t)i) != 0) {
+      myfuse_nonfatal("warmup: failed to create prefetch thread");
+      break;
+    }
+    warmup.nprefetcher++;
+  }
+
+  warmup.has_saver = 0;
+  if (interval != 0) {
+    if (pthread_create(&warmup.saver, NULL, save_worker, NULL) != 0) {
+      myfuse_nonfatal("warmup: failed to create save thread");
+    } else {
+      warmup.has_saver = 1;
+    }
+  }
+}
+
+void warmup_stop() {
+  pthread_mutex_lock(&warmup.lock);
+  __atomic_store_n(&warmup.stop, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&warmup.wakeup);
+  pthread_mutex_unlock(&warmup.lock);
+
+  for (int i = 0; i < warmup.nprefetcher; i++) {
+    pthread_join(warmup.prefetcher[i], NULL);
+  }
+  if (warmup.has_saver) {
+    pthread_join(warmup.saver, NULL);
+  }
+  free(warmup.blocknos);
+  warmup.blocknos = NULL;
+  warmup.n        = 0;
+
+  warmup_save(warmup.path, warmup.sb);
+}
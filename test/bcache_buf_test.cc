@@ -1,5 +1,13 @@
 #include <gtest/gtest.h>
 #include "test_def.h"
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+#include <thread>
+
+extern "C" {
+#include "warmup.h"
+}
 
 TestEnvironment* env;
 
@@ -67,6 +75,150 @@ TEST(bcache_buf, parallel_read_write_test) {
   start_worker(test_read_worker);
 }
 
+TEST(bcache_buf, warmup_save_load_test) {
+  const char* warmup_path = DISK_IMG_PATH ".warmup";
+  std::vector<uint> touched;
+  for (int i = 0; i < 100; i++) {
+    uint blockno = rand() % MAX_BLOCK_NO;
+    brelse(bread(blockno));
+    touched.push_back(blockno);
+  }
+  ASSERT_EQ(warmup_save(warmup_path, &MYFUSE_STATE->sb), 0);
+
+  FILE* f = fopen(warmup_path, "rb");
+  ASSERT_NE(f, nullptr);
+  struct warmup_header header;
+  ASSERT_EQ(fread(&header, sizeof(header), 1, f), 1);
+  EXPECT_EQ(header.magic, WARMUP_MAGIC);
+  EXPECT_EQ(header.fssize, MYFUSE_STATE->sb.size);
+  std::vector<uint> saved(header.n);
+  ASSERT_EQ(fread(saved.data(), sizeof(uint), header.n, f), header.n);
+  fclose(f);
+  std::set<uint> saved_set(saved.begin(), saved.end());
+  // the last one read can't have been recycled yet
+  EXPECT_TRUE(saved_set.count(touched.back()));
+  for (uint blockno : saved) {
+    EXPECT_LT(blockno, MYFUSE_STATE->sb.size);
+  }
+
+  // prefetch them back, the cache must stay usable meanwhile
+  warmup_start(warmup_path, &MYFUSE_STATE->sb, 0);
+  for (uint blockno : touched) {
+    brelse(bread(blockno));
+  }
+  warmup_stop();
+  remove(warmup_path);
+}
+
+TEST(bcache_buf, hot_blocks_order_test) {
+  uint cold = rand() % MAX_BLOCK_NO;
+  uint hot  = (cold + 1) % MAX_BLOCK_NO;
+  brelse(bread(cold));
+  // timestamps are coarse, keep the two apart
+  usleep(20000);
+  for (int i = 0; i < 100; i++) {
+    uint blockno = rand() % MAX_BLOCK_NO;
+    if (blockno != cold && blockno != hot) {
+      brelse(bread(blockno));
+    }
+  }
+  usleep(20000);
+  brelse(bread(hot));
+
+  std::vector<uint> saved(NCACHE_BUF);
+  uint n = bcache_hot_blocks(saved.data(), NCACHE_BUF);
+  ASSERT_GT(n, 0u);
+  EXPECT_EQ(saved[0], hot);
+  auto cold_at = std::find(saved.begin(), saved.begin() + n, cold);
+  auto hot_at  = std::find(saved.begin(), saved.begin() + n, hot);
+  EXPECT_LT(hot_at, cold_at);
+
+  // capped at max, and still the most recent first
+  uint one = 0;
+  EXPECT_EQ(bcache_hot_blocks(&one, 1), 1u);
+  EXPECT_EQ(one, hot);
+}
+
+TEST(bcache_buf, shrink_test) {
+  std::vector<uint> blocknos;
+  for (int i = 0; i < 200; i++) {
+    blocknos.push_back(rand() % MAX_BLOCK_NO);
+    brelse(bread(blocknos.back()));
+  }
+  ASSERT_GT(bcache_nresident(), 0);
+
+  // a referenced buffer must survive
+  auto held = bread(blocknos.back());
+  bcache_shrink(0);
+  EXPECT_EQ(bcache_nresident(), 1);
+  EXPECT_TRUE(held->valid);
+  EXPECT_TRUE(held->resident);
+  brelse(held);
+
+  // released buffers read the disk again
+  std::array<u_char, BSIZE> disk;
+  for (uint blockno : blocknos) {
+    auto b = bread(blockno);
+    read_block_raw(blockno, disk.data());
+    EXPECT_EQ(memcmp(b->data, disk.data(), BSIZE), 0);
+    brelse(b);
+  }
+}
+
+TEST(bcache_buf, front_cache_recycle_test) {
+  uint blockno = rand() % 1000;
+  static_assert(1000 + NCACHE_BUF * BCACHE_HASH_SIZE < MAX_BLOCK_NO);
+  std::array<u_char, BSIZE> disk;
+  read_block_raw(blockno, disk.data());
+  brelse(bread(blockno));
+
+  // recycle every buf of blockno's bucket from another thread, the entry
+  // left in this thread's front cache must not be trusted
+  std::thread recycler([blockno]() {
+    for (uint i = 1; i <= NCACHE_BUF; i++) {
+      brelse(bread(blockno + i * BCACHE_HASH_SIZE));
+    }
+  });
+  recycler.join();
+
+  auto b = bread(blockno);
+  EXPECT_EQ(b->blockno, blockno);
+  EXPECT_EQ(memcmp(b->data, disk.data(), BSIZE), 0);
+  brelse(b);
+}
+
+// microbenchmark: cached reads over a working set of half the cache, so
+// each bget walks a hash chain of about NCACHE_BUF / BCACHE_HASH_SIZE bufs.
+// the data is copied out like inode_read_nbytes_locked does, which is what
+// pushes the headers out of the CPU caches between two lookups.
+// The working set fits: every read hits the buf it was first read in
+TEST(bcache_buf, bget_walk_bench) {
+  std::vector<uint> order(1 << 16);
+  for (auto& blockno : order) {
+    blockno = rand() % (NCACHE_BUF / 2);
+  }
+  std::vector<struct bcache_buf*> bufs;
+  for (uint i = 0; i < NCACHE_BUF / 2; i++) {
+    bufs.push_back(bread(i));
+    brelse(bufs.back());
+  }
+  std::array<u_char, BSIZE> out;
+
+  uint nmiss = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint blockno : order) {
+    auto b = bread(blockno);
+    nmiss += b != bufs[blockno];
+    memcpy(out.data(), b->data, BSIZE);
+    brelse(b);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  EXPECT_EQ(nmiss, 0u);
+  double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  myfuse_log("bget walk: %.1lf ns per cached bread/brelse", ns / order.size());
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   env = reinterpret_cast<TestEnvironment*>(
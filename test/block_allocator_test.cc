@@ -1,7 +1,11 @@
 #include "test_def.h"
 #include "block_allocator.h"
+extern "C" {
+#include "bitmap.h"
+}
 #include <random>
 #include <algorithm>
+#include <chrono>
 
 TestEnvironment* env;
 
@@ -102,6 +106,86 @@ TEST(block_allocator, bmap_block_statue_get_set_test) {
   }
 }
 
+uint naive_next(const std::vector<u_char>& map, uint nbits, uint from,
+                int want) {
+  for (uint i = from; i < nbits; i++) {
+    if (((map[i / 8] >> (i % 8)) & 1) == want) {
+      return i;
+    }
+  }
+  return nbits;
+}
+
+// against a bit by bit scan: sparse and dense maps, lengths not multiple of
+// a word, from any bit
+TEST(block_allocator, bitmap_scan_test) {
+  for (int percent : {0, 1, 50, 99, 100}) {
+    for (uint nbits : {1u, 63u, 64u, 300u, 1000u, (uint)BPB}) {
+      std::vector<u_char> map((nbits + 7) / 8 + 8);
+      for (auto& c : map) {
+        c = rand();
+      }
+      uint ones = 0;
+      for (uint i = 0; i < nbits; i++) {
+        int bit = rand() % 100 < percent;
+        ones += bit;
+        map[i / 8] = (map[i / 8] & ~(1 << (i % 8))) | (bit << (i % 8));
+      }
+      EXPECT_EQ(bitmap_count(map.data(), nbits), ones);
+      for (uint from = 0; from <= nbits; from += 1 + rand() % 40) {
+        EXPECT_EQ(bitmap_next_zero(map.data(), nbits, from),
+                  naive_next(map, nbits, from, 0));
+        EXPECT_EQ(bitmap_next_one(map.data(), nbits, from),
+                  naive_next(map, nbits, from, 1));
+      }
+    }
+  }
+}
+
+// benchmark: mount time refresh, and allocation near the end of an
+// almost full bitmap block. Both agree with a bit by bit scan
+TEST(block_allocator, bitmap_scan_bench) {
+  auto start = std::chrono::steady_clock::now();
+  block_allocator_refresh(&MYFUSE_STATE->sb);
+  auto refresh_time = std::chrono::steady_clock::now() - start;
+  for (uint i = 0; i < bmap_cache.n_cache; i++) {
+    std::vector<u_char> bmap(bmap_cache.cache_buf + i * BSIZE,
+                             bmap_cache.cache_buf + (i + 1) * BSIZE);
+    uint first = naive_next(bmap, BPB, 0, 0);
+    uint ones  = 0;
+    for (uint bit = 0; bit < BPB; bit++) {
+      ones += (bmap[bit / 8] >> (bit % 8)) & 1;
+    }
+    EXPECT_EQ(bmap_cache.n_alloced[i], ones);
+    EXPECT_EQ(bmap_cache.first_unalloced[i], first == BPB ? -1 : (int)first);
+  }
+
+  std::vector<u_char> map(BSIZE, 0xff);
+  map[BSIZE - 1] = 0x7f;
+  const int nscan = 10000;
+  uint nwrong     = 0;
+  start           = std::chrono::steady_clock::now();
+  for (int i = 0; i < nscan; i++) {
+    nwrong += bitmap_next_zero(map.data(), BPB, 0) != BPB - 1;
+  }
+  auto word_time = std::chrono::steady_clock::now() - start;
+  start          = std::chrono::steady_clock::now();
+  uint naive     = 0;
+  for (int i = 0; i < nscan / 100; i++) {
+    naive = naive_next(map, BPB, 0, 0);
+  }
+  auto bit_time = (std::chrono::steady_clock::now() - start) * 100;
+  EXPECT_EQ(naive, BPB - 1);
+  EXPECT_EQ(nwrong, 0u);
+
+  using us = std::chrono::microseconds;
+  myfuse_log("refresh of %u bitmap blocks: %ld us", bmap_cache.n_cache,
+             (long)std::chrono::duration_cast<us>(refresh_time).count());
+  myfuse_log("last free bit of a bitmap block: %.3lf us, bit by bit %.3lf us",
+             std::chrono::duration_cast<us>(word_time).count() / (double)nscan,
+             std::chrono::duration_cast<us>(bit_time).count() / (double)nscan);
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   env = reinterpret_cast<TestEnvironment*>(
@@ -2,6 +2,7 @@
 #include <array>
 #include <algorithm>
 #include <random>
+#include <vector>
 
 TestEnvironment* env;
 
@@ -26,6 +27,28 @@ TEST(block_device, read_write_test) {
   }
 }
 
+TEST(block_device, vectored_write_test) {
+  // more blocks than a single writev takes
+  const uint nblocks = 1100;
+  std::vector<std::array<u_char, BSIZE>> blocks(nblocks);
+  std::vector<const u_char*> bufs;
+  for (auto& block : blocks) {
+    for (auto& c : block) {
+      c = rand() % 0x100;
+    }
+    bufs.push_back(block.data());
+  }
+  uint start = rand() % (MAX_BLOCK_NO - nblocks);
+  EXPECT_EQ(write_blocks_vec_raw(start, bufs.data(), nblocks),
+            nblocks * BSIZE);
+
+  std::array<u_char, BSIZE> read_buf;
+  for (uint i = 0; i < nblocks; i++) {
+    read_block_raw(start + i, read_buf.data());
+    EXPECT_EQ(read_buf, blocks[i]);
+  }
+}
+
 TEST(block_device, random_read_write_test) {
   // write all the disk here
   nmeta_blocks = 0;
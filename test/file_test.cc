@@ -1,4 +1,5 @@
 #include "test_def.h"
+#include <thread>
 
 TestEnvironment* env;
 
@@ -146,6 +147,54 @@ TEST(file, file_open_close) {
   start_worker(file_read_worker, MAX_WORKER, files.size());
 }
 
+// fsync commits the transaction of the file's last change at once,
+// fdatasync only of the last change to its contents. fsyncs at once share
+// the commit
+TEST(file, fsync_test) {
+  log_commit_interval_ms = 1000;
+  const char* path       = "/fsync_test";
+  struct fuse_file_info fi;
+  fi.flags = O_CREAT | O_RDWR;
+  ASSERT_EQ(myfuse_open(path, &fi), 0);
+  auto ip = ((struct file*)fi.fh)->ip;
+
+  std::array<char, 2 * BSIZE> content;
+  content.fill('a');
+  EXPECT_EQ(myfuse_write(path, content.data(), content.size(), 100, &fi),
+            content.size());
+  EXPECT_LT(log_committed_tid(), ip->datasync_tid);
+  EXPECT_EQ(myfuse_fsync(path, 1, &fi), 0);
+  EXPECT_GE(log_committed_tid(), ip->datasync_tid);
+
+  // the permissions aren't contents
+  uint64_t tid = log_committed_tid();
+  EXPECT_EQ(myfuse_chmod(path, 0600, &fi), 0);
+  EXPECT_EQ(myfuse_fsync(path, 1, &fi), 0);
+  EXPECT_EQ(log_committed_tid(), tid);
+  EXPECT_EQ(myfuse_fsync(path, 0, &fi), 0);
+  EXPECT_EQ(log_committed_tid(), tid + 1);
+
+  tid = log_committed_tid();
+  EXPECT_EQ(myfuse_write(path, content.data(), content.size(), 0, &fi),
+            content.size());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&] { EXPECT_EQ(myfuse_fsync(path, 0, &fi), 0); });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(log_committed_tid(), tid + 1);
+
+  // the directory entry, without the file open
+  EXPECT_EQ(myfuse_fsyncdir("/", 0, nullptr), 0);
+  EXPECT_EQ(myfuse_fsync(path, 0, nullptr), 0);
+  EXPECT_EQ(myfuse_fsync("/no_such_file", 0, nullptr), -ENOENT);
+
+  myfuse_release(path, &fi);
+  log_commit_interval_ms = LOG_COMMIT_INTERVAL_MS;
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   env = reinterpret_cast<TestEnvironment*>(
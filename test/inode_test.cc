@@ -3,6 +3,9 @@
 #include <cassert>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 TestEnvironment* env;
 
@@ -271,6 +274,10 @@ void exceedTheDisk() {
 }
 
 TEST(inode, truncate2big_test) {
+  // the log commits in its own thread, a forked child wouldn't have it.
+  // the child formats the disk again, nothing may be left to commit here
+  GTEST_FLAG_SET(death_test_style, "threadsafe");
+  log_sync();
   EXPECT_EXIT(exceedTheDisk(); exit(0), testing::ExitedWithCode(1), "");
 }
 
@@ -298,6 +305,73 @@ TEST(inode, truncate_test) {
   }
 }
 
+// growing a file by truncate restarts its op and unlocks it meanwhile:
+// readers see it as before or as after, never in between
+TEST(inode, truncate_grow_concurrent_read_test) {
+  const size_t old_size = 3 * BSIZE + 100;
+  const size_t new_size = old_size + 32 * INODE_WRITE_CHUNK_NBLOCKS * BSIZE;
+  std::vector<char> content(old_size);
+  for (char& c : content) {
+    c = rand() % 0x100;
+  }
+  begin_op();
+  auto ip = ialloc(T_FILE_INODE_MYFUSE);
+  end_op();
+
+  for (int round = 0; round < 4; round++) {
+    EXPECT_EQ(inode_write_nbytes_unlocked(ip, content.data(), old_size, 0),
+              old_size);
+    std::atomic<bool> done(false);
+    std::atomic<int> nwrong(0);
+    std::vector<std::thread> threads;
+    for (int r = 0; r < 4; r++) {
+      threads.emplace_back([&]() {
+        std::vector<char> buf(2 * BSIZE);
+        while (!done) {
+          // the old tail, and the start of the new blocks
+          size_t off = old_size - BSIZE;
+          long n = inode_read_nbytes_unlocked(ip, buf.data(), buf.size(), off);
+          if (n != (long)BSIZE && n != (long)buf.size()) {
+            nwrong++;
+            continue;
+          }
+          nwrong += memcmp(buf.data(), &content[off], BSIZE) != 0;
+          nwrong += n > (long)BSIZE &&
+                    std::count(buf.begin() + BSIZE, buf.end(), 0) != BSIZE;
+        }
+      });
+    }
+    // closes the transactions often, so the truncate has to restart its op
+    threads.emplace_back([&]() {
+      while (!done) {
+        log_sync();
+      }
+    });
+
+    begin_op();
+    ilock(ip);
+    itrunc2size(ip, new_size);
+    EXPECT_EQ(ip->size, new_size);
+    iunlock(ip);
+    end_op();
+    done = true;
+    for (auto& t : threads) {
+      t.join();
+    }
+    EXPECT_EQ(nwrong, 0);
+
+    begin_op();
+    ilock(ip);
+    itrunc2size(ip, 0);
+    iunlock(ip);
+    end_op();
+  }
+
+  begin_op();
+  iput(ip);
+  end_op();
+}
+
 TEST(inode, unaligned_random_read_write_test) {
   write_max_size = MAXOPBLOCKS * BSIZE;
   read_max_size  = MAXOPBLOCKS * BSIZE;
@@ -381,6 +455,339 @@ TEST(inode, single_big_read_write_test) {
   EXPECT_EQ(big_file_content, big_file_buf);
 }
 
+TEST(inode, itable_shrink_test) {
+  std::vector<struct inode*> inodes;
+  begin_op();
+  for (int i = 0; i < 200; i++) {
+    inodes.push_back(ialloc(T_FILE_INODE_MYFUSE));
+  }
+  end_op();
+
+  // keep the first half referenced
+  begin_op();
+  for (size_t i = inodes.size() / 2; i < inodes.size(); i++) {
+    iput(inodes[i]);
+  }
+  end_op();
+  EXPECT_GT(itable_shrink(), 0);
+  for (size_t i = 0; i < inodes.size() / 2; i++) {
+    EXPECT_EQ(iget(inodes[i]->inum), inodes[i]);
+    EXPECT_EQ(inodes[i]->ref, 2);
+  }
+
+  begin_op();
+  for (size_t i = 0; i < inodes.size() / 2; i++) {
+    iput(inodes[i]);
+    iput(inodes[i]);
+  }
+  end_op();
+  itable_shrink();
+  auto ip = iget(ROOTINO);
+  ilock(ip);
+  EXPECT_EQ(ip->type, T_DIR_INODE_MYFUSE);
+  iunlock(ip);
+  begin_op();
+  iput(ip);
+  end_op();
+}
+
+TEST(inode, bypass_cache_coherence_test) {
+  begin_op();
+  single_inode = ialloc(T_FILE_INODE_MYFUSE);
+  end_op();
+
+  const size_t nbytes = 64 * BSIZE;
+  ASSERT_GE(nbytes, bypass_cache_threshold);
+  std::vector<char> old_content(nbytes), new_content(nbytes), buf(nbytes);
+  for (size_t i = 0; i < nbytes; i++) {
+    old_content[i] = rand() % 0x100;
+    new_content[i] = rand() % 0x100;
+  }
+
+  // through the cache, block by block
+  for (size_t off = 0; off < nbytes; off += BSIZE) {
+    EXPECT_EQ(inode_write_nbytes_unlocked(single_inode, &old_content[off],
+                                          BSIZE, off),
+              BSIZE);
+  }
+  // bring some of the blocks into the cache
+  for (size_t off = 0; off < nbytes; off += 3 * BSIZE) {
+    EXPECT_EQ(inode_read_nbytes_unlocked(single_inode, buf.data(), BSIZE, off),
+              BSIZE);
+  }
+
+  // overwrite behind the cache, the cached copies must not be served after
+  EXPECT_EQ(inode_write_nbytes_unlocked(single_inode, new_content.data(),
+                                        nbytes, 0),
+            nbytes);
+  for (size_t off = 0; off < nbytes; off += BSIZE) {
+    EXPECT_EQ(inode_read_nbytes_unlocked(single_inode, buf.data(), BSIZE, off),
+              BSIZE);
+    EXPECT_EQ(memcmp(buf.data(), &new_content[off], BSIZE), 0);
+  }
+  EXPECT_EQ(inode_read_nbytes_unlocked(single_inode, buf.data(), nbytes, 0),
+            nbytes);
+  EXPECT_EQ(buf, new_content);
+
+  begin_op();
+  iput(single_inode);
+  end_op();
+}
+
+// with --data=journal a big overwrite goes through the log like a small one
+TEST(inode, bypass_cache_journal_mode_test) {
+  log_data_mode = LOG_DATA_JOURNAL;
+  begin_op();
+  auto ip = ialloc(T_FILE_INODE_MYFUSE);
+  end_op();
+
+  const size_t nbytes = 64 * BSIZE;
+  ASSERT_GE(nbytes, bypass_cache_threshold);
+  std::vector<char> old_content(nbytes), new_content(nbytes), buf(nbytes);
+  for (size_t i = 0; i < nbytes; i++) {
+    old_content[i] = rand() % 0x100;
+    new_content[i] = old_content[i] ^ (1 + rand() % 0xff);
+  }
+  EXPECT_EQ(inode_write_nbytes_unlocked(ip, old_content.data(), nbytes, 0),
+            nbytes);
+  log_checkpoint();
+
+  EXPECT_EQ(inode_write_nbytes_unlocked(ip, new_content.data(), nbytes, 0),
+            nbytes);
+  log_sync();
+  // committed, in the log only until the checkpoint
+  std::array<char, BSIZE> disk;
+  for (uint bn = 0; bn < nbytes / BSIZE; bn++) {
+    uint blockno = imap2blockno_lookup(ip, bn);
+    EXPECT_TRUE(log_block_pending(blockno));
+    read_block_raw(blockno, (u_char*)disk.data());
+    EXPECT_EQ(memcmp(disk.data(), &old_content[bn * BSIZE], BSIZE), 0);
+  }
+  log_checkpoint();
+  for (uint bn = 0; bn < nbytes / BSIZE; bn++) {
+    read_block_raw(imap2blockno_lookup(ip, bn), (u_char*)disk.data());
+    EXPECT_EQ(memcmp(disk.data(), &new_content[bn * BSIZE], BSIZE), 0);
+  }
+  EXPECT_EQ(inode_read_nbytes_unlocked(ip, buf.data(), nbytes, 0), nbytes);
+  EXPECT_EQ(buf, new_content);
+
+  begin_op();
+  iput(ip);
+  end_op();
+  log_checkpoint();
+  log_data_mode = LOG_DATA_ORDERED;
+}
+
+TEST(inode, read_hole_outside_op_test) {
+  begin_op();
+  auto ip = ialloc(T_FILE_INODE_MYFUSE);
+  end_op();
+
+  // the holes span the direct blocks and the start of the first indirect one
+  const uint nhole = NDIRECT + bypass_cache_threshold / BSIZE;
+  const char one   = 1;
+  EXPECT_EQ(inode_write_nbytes_unlocked(ip, &one, 1, nhole * BSIZE), 1);
+
+  // both the cached and the bypassing paths read holes as zeros, and neither
+  // allocates blocks for them
+  std::vector<char> buf((nhole + 1) * BSIZE);
+  for (size_t nbytes : {(size_t)BSIZE, buf.size()}) {
+    std::fill(buf.begin(), buf.end(), 0x5a);
+    for (size_t off = 0; off < buf.size(); off += nbytes) {
+      auto nread = inode_read_nbytes_unlocked(ip, &buf[off], nbytes, off);
+      EXPECT_EQ(nread, std::min(nbytes, nhole * BSIZE + 1 - off));
+    }
+    EXPECT_EQ(std::count(buf.begin(), buf.begin() + nhole * BSIZE, 0),
+              nhole * BSIZE);
+    EXPECT_EQ(buf[nhole * BSIZE], one);
+  }
+  for (uint bn = 0; bn < nhole; bn++) {
+    EXPECT_EQ(imap2blockno_lookup(ip, bn), 0u);
+  }
+  EXPECT_NE(imap2blockno_lookup(ip, nhole), 0u);
+
+  begin_op();
+  iput(ip);
+  end_op();
+}
+
+// a write of many chunks is carried by one op, through the cache or behind
+// it: it doesn't end the op (and the transaction) while there is room
+TEST(inode, streaming_write_test) {
+  const size_t nbytes = 4 * INODE_WRITE_CHUNK_NBLOCKS * BSIZE + 123;
+  const size_t off    = 100;
+  std::vector<char> content(nbytes), buf(nbytes);
+  for (char& c : content) {
+    c = rand() % 0x100;
+  }
+
+  log_commit_interval_ms = 1000;
+  for (size_t threshold : {(size_t)0, (size_t)BYPASS_CACHE_THRESHOLD}) {
+    bypass_cache_threshold = threshold;
+    begin_op();
+    auto ip = ialloc(T_FILE_INODE_MYFUSE);
+    end_op();
+    log_sync();
+    uint64_t tid = log_committed_tid();
+
+    EXPECT_EQ(inode_write_nbytes_unlocked(ip, content.data(), nbytes, off),
+              nbytes);
+    log_sync();
+    EXPECT_EQ(log_committed_tid(), tid + 1);
+
+    EXPECT_EQ(ip->size, off + nbytes);
+    EXPECT_EQ(inode_read_nbytes_unlocked(ip, buf.data(), nbytes, off), nbytes);
+    EXPECT_EQ(buf, content);
+
+    begin_op();
+    iput(ip);
+    end_op();
+  }
+  log_commit_interval_ms = LOG_COMMIT_INTERVAL_MS;
+  bypass_cache_threshold = BYPASS_CACHE_THRESHOLD;
+}
+
+// the number of physically contiguous runs the first nblocks blocks of ip
+// are in
+uint inode_nextent(struct inode* ip, uint nblocks) {
+  uint nextent = 0;
+  uint last    = 0;
+  for (uint i = 0; i < nblocks; i++) {
+    uint addr = imap2blockno_lookup(ip, i);
+    nextent += addr != last + 1;
+    last = addr;
+  }
+  return nextent;
+}
+
+// free space left in single block gaps: allocating block by block fills
+// them, a file growing by large writes or truncate takes contiguous runs
+TEST(inode, extent_alloc_test) {
+  const uint nblocks = 4 * INODE_WRITE_CHUNK_NBLOCKS;
+  std::vector<uint> gaps, kept;
+  for (uint i = 0; i < 2 * nblocks; i++) {
+    begin_op();
+    (i % 2 ? gaps : kept).push_back(block_alloc());
+    end_op();
+  }
+  for (uint blockno : gaps) {
+    begin_op();
+    block_free(blockno);
+    end_op();
+  }
+  log_sync();
+
+  // before: one block at a time
+  std::vector<uint> single;
+  for (uint i = 0; i < nblocks; i++) {
+    begin_op();
+    single.push_back(block_alloc_data());
+    end_op();
+  }
+  uint nextent_single = 0;
+  for (uint i = 0; i < nblocks; i++) {
+    nextent_single += i == 0 || single[i] != single[i - 1] + 1;
+  }
+  for (uint blockno : single) {
+    begin_op();
+    block_free(blockno);
+    end_op();
+  }
+  log_sync();
+
+  std::vector<char> content(nblocks * BSIZE, 1);
+  begin_op();
+  auto written = ialloc(T_FILE_INODE_MYFUSE);
+  end_op();
+  EXPECT_EQ(inode_write_nbytes_unlocked(written, content.data(),
+                                        content.size(), 0),
+            content.size());
+  uint nextent_write = inode_nextent(written, nblocks);
+
+  begin_op();
+  auto truncated = ialloc(T_FILE_INODE_MYFUSE);
+  ilock(truncated);
+  itrunc2size(truncated, nblocks * BSIZE);
+  iunlock(truncated);
+  end_op();
+  uint nextent_truncate = inode_nextent(truncated, nblocks);
+
+  myfuse_log("%u blocks in %u extents allocated one by one, %u written, "
+             "%u truncated",
+             nblocks, nextent_single, nextent_write, nextent_truncate);
+  EXPECT_GT(nextent_single, nblocks / 2);
+  EXPECT_LE(nextent_write, 2);
+  EXPECT_LE(nextent_truncate, 2);
+
+  begin_op();
+  iput(written);
+  iput(truncated);
+  end_op();
+  for (uint blockno : kept) {
+    begin_op();
+    block_free(blockno);
+    end_op();
+  }
+}
+
+// freeing blocks takes none: with the disk full, a sparse file is cut
+// across its indirect levels and a big file is deleted
+TEST(inode, free_on_full_disk_test) {
+  const uint nbig   = NDIRECT + 2 * NINDIRECT1;
+  const uint far_bn = NDIRECT + NINDIRECT1 + NINDIRECT2;
+  const char one    = 1;
+  begin_op();
+  auto big    = ialloc(T_FILE_INODE_MYFUSE);
+  auto sparse = ialloc(T_FILE_INODE_MYFUSE);
+  ilock(big);
+  itrunc2size(big, nbig * BSIZE);
+  iunlock(big);
+  end_op();
+  // no second indirect block, the third level is reached past it
+  EXPECT_EQ(inode_write_nbytes_unlocked(sparse, &one, 1, 0), 1);
+  EXPECT_EQ(inode_write_nbytes_unlocked(sparse, &one, 1, far_bn * BSIZE), 1);
+  EXPECT_EQ(sparse->addrs[NDIRECT + 1], 0u);
+  log_sync();
+
+  std::vector<std::pair<uint, uint>> runs;
+  for (;;) {
+    uint n;
+    begin_op();
+    uint addr = block_alloc_extent(0, 1, BPB, &n);
+    end_op();
+    if (addr == 0) {
+      break;
+    }
+    runs.emplace_back(addr, n);
+  }
+  ASSERT_FALSE(runs.empty());
+
+  begin_op();
+  ilock(sparse);
+  itrunc2size(sparse, 1);
+  iunlock(sparse);
+  iput(big);
+  end_op();
+  EXPECT_EQ(sparse->addrs[NDIRECT + 1], 0u);
+  EXPECT_EQ(imap2blockno_lookup(sparse, far_bn), 0u);
+
+  // and what was freed can be allocated again once committed
+  log_sync();
+  begin_op();
+  uint blockno = block_alloc();
+  EXPECT_NE(blockno, 0u);
+  block_free(blockno);
+  iput(sparse);
+  end_op();
+  for (auto run : runs) {
+    begin_op();
+    for (uint i = 0; i < run.second; i++) {
+      block_free(run.first + i);
+    }
+    end_op();
+  }
+}
+
 TEST(inode, parrallel_block_aligned_read_write_test) {
   begin_op();
   single_inode = ialloc(T_FILE_INODE_MYFUSE);
@@ -1,5 +1,15 @@
 #include <gtest/gtest.h>
 #include "test_def.h"
+extern "C" {
+#include "crc32c.h"
+}
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 TestEnvironment* env;
 
@@ -25,7 +35,7 @@ void* test_write_worker(void* _range) {
     EXPECT_EQ(0, memcmp(b->data, contents[blockno], BSIZE));
     EXPECT_EQ(blockno, b->blockno);
     logged_relse(b);
-    if (n_log_wrote >= MAXOPBLOCKS - 1) {
+    if (log_op_room() == 0) {
       in_op = 0;
       end_op();
     }
@@ -60,6 +70,669 @@ TEST(log_test, begin_end_op_test) {
   }
 }
 
+TEST(log_test, end_op_sync_test) {
+  std::array<u_char, BSIZE> disk;
+  for (int i = 0; i < 10; i++) {
+    uint blockno = nmeta_blocks + rand() % (MAX_BLOCK_NO - nmeta_blocks);
+    begin_op();
+    std::array<u_char, BSIZE> content;
+    for (auto& c : content) {
+      c = rand() % 0x100;
+    }
+    auto b = logged_read(blockno);
+    memcpy(b->data, content.data(), BSIZE);
+    logged_write(b);
+    logged_relse(b);
+    // durable in the log once end_op_sync() returns, at its place once
+    // checkpointed
+    end_op_sync();
+    log_checkpoint();
+    read_block_raw(blockno, disk.data());
+    EXPECT_EQ(content, disk);
+  }
+}
+
+// only a block new to the transaction takes the op's reservation
+TEST(log_test, reserve_test) {
+  uint blockno = nmeta_blocks + rand() % (MAX_BLOCK_NO - nmeta_blocks - 1);
+  begin_op_reserve(1);
+  EXPECT_EQ(log_op_room(), 1);
+  for (int i = 0; i < 3; i++) {
+    auto b = logged_read(blockno);
+    b->data[0]++;
+    logged_write(b);
+    logged_relse(b);
+    EXPECT_EQ(log_op_room(), 0);
+  }
+  ASSERT_TRUE(log_extend_op(1));
+  EXPECT_EQ(log_op_room(), 1);
+  auto b = logged_read(blockno + 1);
+  b->data[0]++;
+  logged_write(b);
+  logged_relse(b);
+  EXPECT_EQ(log_op_room(), 0);
+  end_op();
+  log_checkpoint();
+}
+
+// ops reserving a few blocks run at once, more of them than could if each
+// reserved MAXOPBLOCKS
+TEST(log_test, small_reservations_test) {
+  const int nop = 4 * LOG_MAX_NBLOCKS / MAXOPBLOCKS;
+  std::atomic<int> nbegun(0);
+  std::atomic<int> nconcurrent(0);
+  std::vector<std::thread> ops;
+  for (int i = 0; i < nop; i++) {
+    ops.emplace_back([i, &nbegun, &nconcurrent]() {
+      begin_op_reserve(2);
+      nbegun++;
+      for (int j = 0; j < 2; j++) {
+        auto b = logged_read(nmeta_blocks + i * 2 + j);
+        b->data[0]++;
+        logged_write(b);
+        logged_relse(b);
+      }
+      // the ops begun first wait for the others, a while
+      auto deadline =
+          std::chrono::steady_clock::now() + std::chrono::seconds(2);
+      while (nbegun < nop && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+      }
+      if (nbegun == nop) {
+        nconcurrent++;
+      }
+      end_op();
+    });
+  }
+  for (auto& op : ops) {
+    op.join();
+  }
+  EXPECT_EQ(nconcurrent, nop);
+  log_checkpoint();
+}
+
+// ordered data is at its place once committed, journaled data only in the
+// log until the checkpoint
+TEST(log_test, data_mode_test) {
+  std::array<u_char, BSIZE> content;
+  std::array<u_char, BSIZE> disk;
+  for (int mode : {LOG_DATA_ORDERED, LOG_DATA_JOURNAL}) {
+    log_data_mode = mode;
+    uint blockno  = nmeta_blocks + rand() % (MAX_BLOCK_NO - nmeta_blocks);
+    read_block_raw(blockno, disk.data());
+    for (uint i = 0; i < BSIZE; i++) {
+      content[i] = disk[i] ^ (1 + rand() % 0xff);
+    }
+
+    begin_op();
+    auto b = logged_read(blockno);
+    memcpy(b->data, content.data(), BSIZE);
+    logged_write_data(b);
+    logged_relse(b);
+    end_op_sync();
+
+    read_block_raw(blockno, disk.data());
+    if (mode == LOG_DATA_ORDERED) {
+      EXPECT_EQ(content, disk);
+      EXPECT_FALSE(log_block_pending(blockno));
+    } else {
+      EXPECT_NE(content, disk);
+      EXPECT_TRUE(log_block_pending(blockno));
+      log_checkpoint();
+      read_block_raw(blockno, disk.data());
+      EXPECT_EQ(content, disk);
+    }
+  }
+  log_data_mode = LOG_DATA_ORDERED;
+}
+
+// ops ended within the commit interval are committed together, once it's
+// over
+TEST(log_test, commit_interval_test) {
+  const int interval_ms  = 500;
+  log_commit_interval_ms = interval_ms;
+  log_sync();
+  uint64_t tid = log_committed_tid();
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 10; i++) {
+    uint blockno = nmeta_blocks + rand() % (MAX_BLOCK_NO - nmeta_blocks);
+    begin_op_reserve(1);
+    auto b = logged_read(blockno);
+    b->data[0]++;
+    logged_write(b);
+    logged_relse(b);
+    end_op();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms / 5));
+  EXPECT_EQ(log_committed_tid(), tid);
+
+  while (log_committed_tid() == tid &&
+         std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(log_committed_tid(), tid + 1);
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(interval_ms));
+
+  log_commit_interval_ms = LOG_COMMIT_INTERVAL_MS;
+  log_checkpoint();
+}
+
+const int nrecovery_block = 16;
+// blocks a transaction of the benchmarks and fillers logs
+const int nblock_per_trans = 64;
+std::array<uint, nrecovery_block> recovery_blocknos;
+std::array<std::array<u_char, BSIZE>, nrecovery_block> recovery_contents;
+
+// pick the blocks to recover, and contents they don't have on disk yet
+void random_recovery_blocks() {
+  std::array<u_char, BSIZE> disk;
+  for (int i = 0; i < nrecovery_block; i++) {
+    do {
+      recovery_blocknos[i] =
+          nmeta_blocks + rand() % (MAX_BLOCK_NO - nmeta_blocks);
+    } while (std::count(recovery_blocknos.begin(),
+                        recovery_blocknos.begin() + i,
+                        recovery_blocknos[i]) > 0);
+    read_block_raw(recovery_blocknos[i], disk.data());
+    for (uint j = 0; j < BSIZE; j++) {
+      recovery_contents[i][j] = disk[j] ^ (1 + rand() % 0xff);
+    }
+  }
+}
+
+// log the blocks, and crash once committed
+void commit_and_crash(struct superblock* sb = &MYFUSE_STATE->sb) {
+  log_init(sb);
+  begin_op();
+  for (int i = 0; i < nrecovery_block; i++) {
+    auto b = logged_read(recovery_blocknos[i]);
+    memcpy(b->data, recovery_contents[i].data(), BSIZE);
+    logged_write(b);
+    logged_relse(b);
+  }
+  end_op_sync();
+  _exit(0);
+}
+
+// @return the number of blocks not recovered
+int recover_and_check(struct superblock* sb = &MYFUSE_STATE->sb) {
+  log_init(sb);
+  std::array<u_char, BSIZE> disk;
+  int failed = 0;
+  for (int i = 0; i < nrecovery_block; i++) {
+    read_block_raw(recovery_blocknos[i], disk.data());
+    failed += disk != recovery_contents[i];
+  }
+  return failed;
+}
+
+// crash before the checkpoint: the next log_init() replays the log.
+// fork() only keeps the calling thread, so both children start a journal
+// thread of their own with log_init()
+TEST(log_test, recovery_test) {
+  GTEST_FLAG_SET(death_test_style, "fast");
+  random_recovery_blocks();
+
+  EXPECT_EXIT(commit_and_crash(), ::testing::ExitedWithCode(0), "");
+  EXPECT_EXIT(_exit(recover_and_check()), ::testing::ExitedWithCode(0), "");
+}
+
+// where the log on the disk starts, the next transaction goes there once
+// it's checkpointed
+uint64_t log_tail_on_disk() {
+  std::array<u_char, BSIZE> block;
+  read_block_raw(MYFUSE_STATE->sb.logstart, block.data());
+  return ((struct fslogsuper*)block.data())->tail;
+}
+
+uint log_pos_blockno(uint64_t pos) {
+  auto sb = &MYFUSE_STATE->sb;
+  return sb->logstart + 1 + pos % (sb->nlog - 1);
+}
+
+// the first block of the descriptor at pos, @return the log blocks it takes
+int read_log_desc(uint64_t pos, std::array<u_char, BSIZE>& block) {
+  read_block_raw(log_pos_blockno(pos), block.data());
+  return (((struct fslogheader*)block.data())->size + BSIZE - 1) / BSIZE;
+}
+
+// a transaction partly written before the crash isn't replayed at all
+TEST(log_test, torn_transaction_test) {
+  GTEST_FLAG_SET(death_test_style, "fast");
+  random_recovery_blocks();
+  log_checkpoint();
+  const uint64_t head = log_tail_on_disk();
+  EXPECT_EXIT(commit_and_crash(), ::testing::ExitedWithCode(0), "");
+
+  // as if the write of one of the logged blocks didn't make it. It's looked
+  // for in the transaction only, the log may hold the same content from
+  // before
+  std::array<u_char, BSIZE> block;
+  int ndesc = read_log_desc(head, block);
+  auto lh   = (struct fslogheader*)block.data();
+  ASSERT_EQ(lh->magic, LOG_MAGIC);
+  ASSERT_EQ(lh->n, nrecovery_block);
+  const uint torn = recovery_blocknos[nrecovery_block / 2];
+  const int index = std::find(lh->block, lh->block + lh->n, torn) - lh->block;
+  ASSERT_LT(index, lh->n);
+  const uint blockno = log_pos_blockno(head + ndesc + index);
+  read_block_raw(blockno, block.data());
+  ASSERT_EQ(block, recovery_contents[nrecovery_block / 2]);
+  block[0]++;
+  write_block_raw(blockno, block.data());
+
+  EXPECT_EXIT(_exit(recover_and_check()),
+              ::testing::ExitedWithCode(nrecovery_block), "");
+}
+
+// the log on an external journal: the disk's log section is left alone, the
+// journal of another file system is refused. only the children open the
+// journal, the journal thread of the parent keeps using the disk
+TEST(log_test, external_journal_test) {
+  GTEST_FLAG_SET(death_test_style, "fast");
+  const char* journal_path = DISK_IMG_PATH ".journal";
+  struct superblock jsb    = MYFUSE_STATE->sb;
+  jsb.nlog                 = NLOG_MIN * 4;
+  jsb.logstart             = JOURNAL_HEADER_ID + 1;
+  jsb.journal              = 1 + rand() % 0xffff;
+
+  unlink(journal_path);
+  int fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, ftruncate(fd, (off_t)(jsb.logstart + jsb.nlog) * BSIZE));
+  std::array<u_char, BSIZE> block;
+  block.fill(0);
+  auto jh     = (struct journal_header*)block.data();
+  jh->magic   = JOURNAL_MAGIC;
+  jh->fsmagic = FSMAGIC;
+  jh->id      = jsb.journal;
+  jh->nlog    = jsb.nlog;
+  ASSERT_EQ(BSIZE, pwrite(fd, block.data(), BSIZE,
+                          (off_t)JOURNAL_HEADER_ID * BSIZE));
+
+  random_recovery_blocks();
+  log_checkpoint();
+  auto sb = &MYFUSE_STATE->sb;
+  std::vector<uint> disk_log_crcs;
+  for (uint i = sb->logstart; i < sb->logstart + sb->nlog; i++) {
+    read_block_raw(i, block.data());
+    disk_log_crcs.push_back(crc32c(0, block.data(), BSIZE));
+  }
+  EXPECT_EXIT(
+      {
+        block_device_init_journal(journal_path);
+        commit_and_crash(&jsb);
+      },
+      ::testing::ExitedWithCode(0), "");
+
+  // logged to the journal only, the disk's log may hold the same content
+  // from before
+  int nchanged_disk  = 0;
+  int nfound_journal = 0;
+  for (uint i = sb->logstart; i < sb->logstart + sb->nlog; i++) {
+    read_block_raw(i, block.data());
+    nchanged_disk +=
+        crc32c(0, block.data(), BSIZE) != disk_log_crcs[i - sb->logstart];
+  }
+  for (uint i = jsb.logstart; i < jsb.logstart + jsb.nlog; i++) {
+    ASSERT_EQ(BSIZE, pread(fd, block.data(), BSIZE, (off_t)i * BSIZE));
+    nfound_journal += block == recovery_contents[0];
+  }
+  close(fd);
+  EXPECT_EQ(nchanged_disk, 0);
+  EXPECT_EQ(nfound_journal, 1);
+
+  struct superblock other = jsb;
+  other.journal++;
+  EXPECT_EXIT(
+      {
+        block_device_init_journal(journal_path);
+        log_init(&other);
+      },
+      ::testing::ExitedWithCode(1), "not the journal");
+  EXPECT_EXIT(
+      {
+        block_device_init_journal(journal_path);
+        _exit(recover_and_check(&jsb));
+      },
+      ::testing::ExitedWithCode(0), "");
+  unlink(journal_path);
+}
+
+// the block logged whole then as deltas, and the one logged as a delta
+// only, on top of its home content
+std::array<uint, 2> delta_blocknos;
+std::array<u_char, BSIZE> delta_whole_content;
+std::array<std::array<u_char, BSIZE>, 2> delta_contents;
+const uint delta_ranges[][2] = {{100, 10}, {BSIZE - 4, 4}, {0, 1}};
+
+void commit_deltas_and_crash() {
+  log_init(&MYFUSE_STATE->sb);
+  begin_op();
+  auto b = logged_read(delta_blocknos[0]);
+  memcpy(b->data, delta_whole_content.data(), BSIZE);
+  logged_write(b);
+  logged_relse(b);
+  end_op_sync();
+  for (auto range : delta_ranges) {
+    begin_op_reserve(2);
+    for (int i = 0; i < 2; i++) {
+      auto b = logged_read(delta_blocknos[i]);
+      memcpy(b->data + range[0], &delta_contents[i][range[0]], range[1]);
+      logged_write_range(b, range[0], range[1]);
+      logged_relse(b);
+    }
+    end_op_sync();
+  }
+  _exit(0);
+}
+
+// @return the number of blocks not recovered
+int recover_deltas_and_check() {
+  log_init(&MYFUSE_STATE->sb);
+  std::array<u_char, BSIZE> disk;
+  int failed = 0;
+  for (int i = 0; i < 2; i++) {
+    read_block_raw(delta_blocknos[i], disk.data());
+    failed += disk != delta_contents[i];
+  }
+  return failed;
+}
+
+// a few bytes changed are logged in the descriptor, and replayed on top of
+// the block as logged whole before, or as at home
+TEST(log_test, delta_recovery_test) {
+  GTEST_FLAG_SET(death_test_style, "fast");
+  random_recovery_blocks();
+  for (int i = 0; i < 2; i++) {
+    delta_blocknos[i] = recovery_blocknos[i];
+    read_block_raw(delta_blocknos[i], delta_contents[i].data());
+  }
+  delta_contents[0][BSIZE / 2] = recovery_contents[0][BSIZE / 2];
+  delta_whole_content          = delta_contents[0];
+  for (int i = 0; i < 2; i++) {
+    for (auto range : delta_ranges) {
+      for (uint j = range[0]; j < range[0] + range[1]; j++) {
+        delta_contents[i][j] = recovery_contents[i][j];
+      }
+    }
+  }
+  log_checkpoint();
+  uint64_t pos = log_tail_on_disk();
+  EXPECT_EXIT(commit_deltas_and_crash(), ::testing::ExitedWithCode(0), "");
+
+  // the block logged whole, then the changed blocks as delta records only
+  std::array<u_char, BSIZE> block;
+  auto lh = (struct fslogheader*)block.data();
+  pos += read_log_desc(pos, block);
+  ASSERT_EQ(lh->magic, LOG_MAGIC);
+  EXPECT_EQ(lh->n, 1);
+  pos += lh->n;
+  for (uint i = 0; i < sizeof(delta_ranges) / sizeof(delta_ranges[0]); i++) {
+    pos += read_log_desc(pos, block);
+    ASSERT_EQ(lh->magic, LOG_MAGIC);
+    EXPECT_EQ(lh->n, 0);
+    EXPECT_EQ(lh->ndelta, 2);
+  }
+
+  EXPECT_EXIT(_exit(recover_deltas_and_check()), ::testing::ExitedWithCode(0),
+              "");
+}
+
+// the first block is freed and reused for data written in place, the second
+// is freed and logged again for something else
+std::array<u_char, BSIZE> revoke_data;
+std::array<u_char, BSIZE> revoke_old_content;
+
+// nfill log blocks of other transactions go between the blocks logged and
+// their revokes
+void commit_revokes_and_crash(int nfill = 0) {
+  log_init(&MYFUSE_STATE->sb);
+  begin_op_reserve(2);
+  for (int i = 0; i < 2; i++) {
+    auto b = logged_read(recovery_blocknos[i]);
+    memcpy(b->data, i == 0 ? recovery_contents[0].data()
+                           : revoke_old_content.data(),
+           BSIZE);
+    logged_write(b);
+    logged_relse(b);
+  }
+  end_op_sync();
+
+  for (int nlogged = 0; nlogged < nfill; nlogged += nblock_per_trans + 1) {
+    begin_op_reserve(nblock_per_trans);
+    for (int i = 0; i < nblock_per_trans; i++) {
+      uint blockno = nmeta_blocks + i;
+      if (std::count(recovery_blocknos.begin(), recovery_blocknos.end(),
+                     blockno) > 0) {
+        continue;
+      }
+      auto b = logged_read(blockno);
+      b->data[0]++;
+      logged_write(b);
+      logged_relse(b);
+    }
+    end_op_sync();
+  }
+  // not checkpointed yet
+  if (!log_block_pending(recovery_blocknos[0])) {
+    _exit(2);
+  }
+
+  begin_op_reserve(1);
+  log_revoke(recovery_blocknos[0]);
+  log_revoke(recovery_blocknos[1]);
+  auto b = logged_read(recovery_blocknos[1]);
+  memcpy(b->data, recovery_contents[1].data(), BSIZE);
+  logged_write(b);
+  logged_relse(b);
+  end_op_sync();
+  if (log_block_pending(recovery_blocknos[0]) ||
+      !log_block_pending(recovery_blocknos[1])) {
+    _exit(1);
+  }
+  write_block_raw(recovery_blocknos[0], revoke_data.data());
+  _exit(0);
+}
+
+// @return the number of blocks not recovered
+int recover_revokes_and_check() {
+  log_init(&MYFUSE_STATE->sb);
+  std::array<u_char, BSIZE> disk;
+  int failed = 0;
+  read_block_raw(recovery_blocknos[0], disk.data());
+  failed += disk != revoke_data;
+  read_block_raw(recovery_blocknos[1], disk.data());
+  failed += disk != recovery_contents[1];
+  return failed;
+}
+
+// a block revoked isn't replayed over what its next owner wrote, unless it
+// was logged again after the revoke
+TEST(log_test, revoke_recovery_test) {
+  GTEST_FLAG_SET(death_test_style, "fast");
+  random_recovery_blocks();
+  for (uint i = 0; i < BSIZE; i++) {
+    revoke_data[i]        = recovery_contents[0][i] ^ (1 + rand() % 0xff);
+    revoke_old_content[i] = recovery_contents[1][i] ^ (1 + rand() % 0xff);
+  }
+
+  EXPECT_EXIT(commit_revokes_and_crash(), ::testing::ExitedWithCode(0), "");
+  EXPECT_EXIT(_exit(recover_revokes_and_check()),
+              ::testing::ExitedWithCode(0), "");
+}
+
+// the same, the revokes read by the recovery in a later batch than the
+// blocks (a batch is about 1300 blocks, the largest transaction)
+TEST(log_test, revoke_far_recovery_test) {
+  GTEST_FLAG_SET(death_test_style, "fast");
+  random_recovery_blocks();
+  for (uint i = 0; i < BSIZE; i++) {
+    revoke_data[i]        = recovery_contents[0][i] ^ (1 + rand() % 0xff);
+    revoke_old_content[i] = recovery_contents[1][i] ^ (1 + rand() % 0xff);
+  }
+
+  // the journal thread checkpoints once half of the log is used
+  int nfill = MYFUSE_STATE->sb.nlog / 2 - 2 * (nblock_per_trans + 4);
+  ASSERT_GT(nfill, 1300);
+  EXPECT_EXIT(commit_revokes_and_crash(nfill), ::testing::ExitedWithCode(0),
+              "");
+  EXPECT_EXIT(_exit(recover_revokes_and_check()),
+              ::testing::ExitedWithCode(0), "");
+}
+
+// the checkpoint doesn't install a block revoked over the data written in
+// place since
+TEST(log_test, revoke_checkpoint_test) {
+  random_recovery_blocks();
+  uint blockno = recovery_blocknos[0];
+
+  begin_op();
+  auto b = logged_read(blockno);
+  memcpy(b->data, recovery_contents[0].data(), BSIZE);
+  logged_write(b);
+  logged_relse(b);
+  end_op_sync();
+  EXPECT_TRUE(log_block_pending(blockno));
+
+  begin_op();
+  log_revoke(blockno);
+  end_op_sync();
+  EXPECT_FALSE(log_block_pending(blockno));
+
+  write_block_raw(blockno, recovery_contents[1].data());
+  binvalidate(blockno);
+  log_checkpoint();
+  std::array<u_char, BSIZE> disk;
+  read_block_raw(blockno, disk.data());
+  EXPECT_EQ(disk, recovery_contents[1]);
+}
+
+// each commit leaves a record of what it logged, and the checkpoint run
+// before it
+TEST(log_test, stats_test) {
+  log_commit_interval_ms = 1000;
+  log_checkpoint();
+  uint blockno[2];
+  blockno[0] = nmeta_blocks + rand() % (MAX_BLOCK_NO - nmeta_blocks - 1);
+  blockno[1] = blockno[0] + 1;
+
+  begin_op_reserve(1);
+  auto b = logged_read(blockno[0]);
+  b->data[0]++;
+  logged_write(b);
+  logged_relse(b);
+  end_op();
+  begin_op_reserve(2);
+  for (uint i : {0, 1}) {
+    b = logged_read(blockno[i]);
+    b->data[1]++;
+    logged_write_range(b, 1, 1);
+    logged_relse(b);
+  }
+  end_op_sync();
+
+  std::array<struct log_commit_stats, 2> records;
+  struct log_stats stats;
+  ASSERT_EQ(log_stats_read(records.data(), 1, &stats), 1);
+  EXPECT_EQ(records[0].tid, log_committed_tid());
+  EXPECT_EQ(records[0].nops, 2u);
+  EXPECT_EQ(records[0].nblocks, 2u);
+  EXPECT_EQ(records[0].nabsorbed, 1u);
+  EXPECT_EQ(records[0].ndelta, 1u);
+  EXPECT_EQ(records[0].nlog, records[0].ndesc + 1);
+  EXPECT_GE(records[0].commit_us, records[0].write_us);
+  uint64_t ncommit = 0;
+  for (uint64_t n : stats.commit_hist) {
+    ncommit += n;
+  }
+  EXPECT_EQ(ncommit, stats.ncommit);
+
+  log_checkpoint();
+  begin_op_reserve(1);
+  b = logged_read(blockno[0]);
+  b->data[0]++;
+  logged_write(b);
+  logged_relse(b);
+  end_op_sync();
+  ASSERT_EQ(log_stats_read(records.data(), 2, &stats), 2);
+  EXPECT_EQ(records[1].tid, records[0].tid + 1);
+  EXPECT_EQ(records[1].ninstall, 2u);
+
+  char* text;
+  size_t size;
+  FILE* f = open_memstream(&text, &size);
+  log_stats_dump(f);
+  fclose(f);
+  EXPECT_NE(strstr(text, "commits"), nullptr);
+  free(text);
+  log_commit_interval_ms = LOG_COMMIT_INTERVAL_MS;
+}
+
+TEST(log_test, crc32c_test) {
+  const char* check = "123456789";
+  EXPECT_EQ(crc32c(0, check, strlen(check)), 0xe3069283);
+  std::array<u_char, 32> zeros;
+  zeros.fill(0);
+  EXPECT_EQ(crc32c(0, zeros.data(), zeros.size()), 0x8a9136aa);
+
+  // chained, from any alignment
+  std::array<u_char, 3 * BSIZE> buf;
+  for (auto& c : buf) {
+    c = rand() % 0x100;
+  }
+  uint whole = crc32c(0, buf.data() + 3, BSIZE * 2);
+  for (uint split : {0ul, 1ul, 7ul, 13ul, BSIZE, BSIZE * 2}) {
+    uint crc = crc32c(0, buf.data() + 3, split);
+    EXPECT_EQ(crc32c(crc, buf.data() + 3 + split, BSIZE * 2 - split), whole);
+  }
+}
+
+TEST(log_test, overlapping_transactions_test) {
+  const int nblock = 8;
+  uint blocknos[nblock];
+  for (int i = 0; i < nblock; i++) {
+    blocknos[i] = nmeta_blocks + i * 7;
+  }
+
+  // the same blocks are modified by every transaction, while the other
+  // thread keeps the journal thread committing
+  std::atomic<bool> done(false);
+  std::thread syncer([&done]() {
+    while (!done) {
+      begin_op();
+      auto b = logged_read(nmeta_blocks + nblock * 7);
+      b->data[0]++;
+      logged_write(b);
+      logged_relse(b);
+      end_op_sync();
+    }
+  });
+  for (int round = 1; round <= 200; round++) {
+    begin_op();
+    for (uint blockno : blocknos) {
+      auto b = logged_read(blockno);
+      memset(b->data, round, BSIZE);
+      logged_write(b);
+      logged_relse(b);
+    }
+    end_op();
+  }
+  done = true;
+  syncer.join();
+
+  log_checkpoint();
+  std::array<u_char, BSIZE> disk;
+  std::array<u_char, BSIZE> expected;
+  expected.fill(200);
+  for (uint blockno : blocknos) {
+    read_block_raw(blockno, disk.data());
+    EXPECT_EQ(disk, expected);
+  }
+}
+
 TEST(log_test, parallel_read_write_test) {
   generate_block_test_data();
   start_worker(test_write_worker, 10);
@@ -88,6 +761,122 @@ TEST(log_test, parallel_read_write_test) {
   start_worker(test_read_worker);
 }
 
+// microbenchmark: logged_write on a running transaction of LOG_COMMIT_NBLOCKS
+// blocks, built by ops of MAXOPBLOCKS - 1 blocks that are kept open so the
+// journal thread can't close it. every call absorbs into a logged block:
+// the transaction commits each block once
+TEST(log_test, logged_write_absorb_bench) {
+  const int nop = LOG_COMMIT_NBLOCKS / MAXOPBLOCKS;
+  log_sync();
+  std::vector<struct bcache_buf*> bufs;
+  for (int op = 0; op < nop; op++) {
+    begin_op();
+    for (int i = 0; i < MAXOPBLOCKS - 1; i++) {
+      auto b = logged_read(nmeta_blocks + bufs.size());
+      logged_write(b);
+      logged_relse(b);
+      bufs.push_back(b);
+    }
+  }
+
+  const int rounds = 1000;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int round = 0; round < rounds; round++) {
+    for (auto b : bufs) {
+      pthread_mutex_lock(&b->lock);
+      logged_write(b);
+      pthread_mutex_unlock(&b->lock);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  for (int op = 0; op < nop; op++) {
+    end_op();
+  }
+  log_sync();
+  struct log_commit_stats record;
+  struct log_stats stats;
+  ASSERT_EQ(log_stats_read(&record, 1, &stats), 1);
+  EXPECT_EQ(record.nops, (uint)nop);
+  EXPECT_EQ(record.nblocks, bufs.size());
+  EXPECT_EQ(record.nabsorbed, rounds * bufs.size());
+
+  double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  myfuse_log("logged_write: %.1lf ns per call on a %lu blocks transaction",
+             ns / (rounds * bufs.size()), bufs.size());
+}
+
+// fill the log of sb with transactions of nblock_per_trans blocks, taken
+// from a working set of nworking blocks, and crash once they're committed
+void fill_log_and_crash(struct superblock* sb, int ntrans, int nworking) {
+  log_init(sb);
+  for (int t = 0; t < ntrans; t++) {
+    begin_op_reserve(nblock_per_trans);
+    for (int i = 0; i < nblock_per_trans; i++) {
+      uint blockno = nmeta_blocks + (t * nblock_per_trans + i) % nworking;
+      auto b       = logged_read(blockno);
+      b->data[0]++;
+      logged_write(b);
+      logged_relse(b);
+    }
+    end_op_sync();
+  }
+  _exit(0);
+}
+
+// @return the number of blocks of the working set not as the last
+// transaction left them
+int recover_and_check_working_set(struct superblock* sb, int nlogged,
+                                  const std::vector<u_char>& before) {
+  log_init(sb);
+  std::array<u_char, BSIZE> disk;
+  int failed = 0;
+  for (int i = 0; i < (int)before.size(); i++) {
+    read_block_raw(nmeta_blocks + i, disk.data());
+    int nwrite = nlogged / before.size() + (i < nlogged % (int)before.size());
+    failed += disk[0] != (u_char)(before[i] + nwrite);
+  }
+  return failed;
+}
+
+// benchmark: mount time spent replaying a log filled up to the checkpoint,
+// for several log sizes. the log of sb is shrunk in place, the children
+// agree on its size
+TEST(log_test, recovery_bench) {
+  GTEST_FLAG_SET(death_test_style, "fast");
+  for (uint nlog : {(uint)NLOG_MIN * 4, (uint)NLOG_MIN * 16,
+                    MYFUSE_STATE->sb.nlog}) {
+    struct superblock sb = MYFUSE_STATE->sb;
+    sb.nlog              = std::min(nlog, sb.nlog);
+    // the journal thread checkpoints once half of the log is used, or half
+    // of the cache is pinned
+    int ntrans   = ((sb.nlog - 1) / 2 - 1) / (nblock_per_trans + 1);
+    int nlogged  = ntrans * nblock_per_trans;
+    int nworking = std::min(nlogged / 2,
+                            (int)LOG_CHECKPOINT_NBLOCKS - nblock_per_trans);
+    std::vector<u_char> before(nworking);
+    std::array<u_char, BSIZE> disk;
+    for (int i = 0; i < nworking; i++) {
+      read_block_raw(nmeta_blocks + i, disk.data());
+      before[i] = disk[0];
+    }
+    EXPECT_EXIT(fill_log_and_crash(&sb, ntrans, nworking),
+                ::testing::ExitedWithCode(0), "");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    EXPECT_EXIT(_exit(recover_and_check_working_set(&sb, nlogged, before)),
+                ::testing::ExitedWithCode(0), "");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms =
+        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    myfuse_log("recovery: %.2lf ms to replay %d blocks (%d distinct) of a "
+               "%u blocks log",
+               ms, nlogged, nworking, sb.nlog);
+  }
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   env = reinterpret_cast<TestEnvironment*>(